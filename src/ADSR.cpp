@@ -1,6 +1,16 @@
 #include "plugin.hpp"
 
+using float_4 = simd::float_4;
 const int maxPolyphony = 16;
+const int maxBanks = maxPolyphony / 4;
+
+/*
+ * Curve shapes shared by all envelope stages. The curvature is the number of time constants of an
+ * exponential a stage spans, zero is a straight line and negative values bend the other way.
+ */
+const int numCurves = 4;
+const char* const curveNames[numCurves] = {"Linear", "Exponential", "Steep exponential", "Inverse exponential"};
+const float curveCurvature[numCurves] = {0.f, 3.f, 7.f, -3.f};
 
 
 /*
@@ -40,9 +50,42 @@ struct ADSR : Module {
 		LIGHTS_LEN
 	};
 
-    bool decaying[maxPolyphony];
-    float env[maxPolyphony];
-    dsp::SchmittTrigger trigger[maxPolyphony];
+    enum Stage {
+        IDLE_STAGE,
+        ATTACK_STAGE,
+        DECAY_STAGE,
+        SUSTAIN_STAGE,
+        RELEASE_STAGE
+    };
+
+    // Envelope state of every channel, stages are selected per lane with masks.
+    // Every sample the envelope advances by env * multiplier + increment, the segment
+    // constants only change on a stage transition or a parameter change.
+    float_4 env[maxBanks] = {};
+    float_4 stage[maxBanks] = {};
+    float_4 elapsed[maxBanks] = {};
+    float_4 multiplier[maxBanks] = {};
+    float_4 increment[maxBanks] = {};
+    float_4 gated[maxBanks] = {};
+    dsp::TSchmittTrigger<float_4> trigger[maxBanks];
+
+    // Per channel stage lengths in samples and sustain level, updated every 4 samples
+    float_4 attackLength[maxBanks] = {};
+    float_4 decayLength[maxBanks] = {};
+    float_4 releaseLength[maxBanks] = {};
+    float_4 sustainLevel[maxBanks] = {};
+
+    // Banks with every envelope at rest and every gate closed skip processing
+    bool idle[maxBanks] = {true, true, true, true};
+
+    int curve = 1;
+    int activeCurve = -1;
+
+    // Long stages drift from rounding, so running segments are aimed again every 256 samples
+    int reaimCounter = 0;
+    int channels = 0;
+    int currentBanks = 0;
+    int loopCounter = 0;
 
 	ADSR() {
 		config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
@@ -63,78 +106,199 @@ struct ADSR : Module {
 		configOutput(OUT_OUTPUT, "Envelope");
 	}
 
+    json_t* dataToJson() override {
+        json_t* rootJ = json_object();
+        json_object_set_new(rootJ, "curve", json_integer(curve));
+        return rootJ;
+    }
+
+    void dataFromJson(json_t* rootJ) override {
+        json_t* curveJ = json_object_get(rootJ, "curve");
+        if (curveJ)
+            curve = clamp((int) json_integer_value(curveJ), 0, numCurves - 1);
+    }
+
     /*
      * Process a single timestep
      */
 	void process(const ProcessArgs& args) override {
+        if (loopCounter-- == 0) {
+            loopCounter = 3;
+            processEvery4Samples(args);
+        }
 
-        // Calculate parameter values
-        float attack = clamp(params[ATCK_PARAM].getValue() + inputs[ATCK_INPUT].getVoltage()*params[ATCK_MOD_PARAM].getValue() / 10.0f, 0.0f, 1.0f);
-        float decay = clamp(params[DEC_PARAM].getValue() + inputs[DEC_INPUT].getVoltage()*params[DEC_MOD_PARAM].getValue() / 10.0f, 0.0f, 1.0f);
-        float sustain = clamp(params[SUS_PARAM].getValue() + inputs[SUS_INPUT].getVoltage()*params[SUS_MOD_PARAM].getValue() / 10.0f, 0.0f, 1.0f);
-        float release = clamp(params[REL_PARAM].getValue() + inputs[REL_INPUT].getVoltage()*params[REL_MOD_PARAM].getValue() / 10.0f, 0.0f, 1.0f);
+        for (int bank = 0; bank < currentBanks; ++bank) {
+            const int currentChannel = bank * 4;
 
-        // Get gate and trigger
-        int channels = inputs[GATE_INPUT].getChannels();
-        outputs[OUT_OUTPUT].setChannels(channels);
+            // Gates opening or retriggering start the attack, gates closing start the release
+            float_4 gate = inputs[GATE_INPUT].getPolyVoltageSimd<float_4>(currentChannel) >= 1.f;
+            float_4 retrigger = trigger[bank].process(inputs[RETR_INPUT].getPolyVoltageSimd<float_4>(currentChannel));
+            float_4 opened = gate & (~gated[bank] | retrigger);
+            float_4 closed = ~gate & gated[bank];
+            gated[bank] = gate;
+
+            // Nothing to do until a gate opens
+            if (idle[bank]) {
+                if (simd::movemask(opened) == 0)
+                    continue;
+                idle[bank] = false;
+            }
 
-        // For each used polyphony channel
-        for (int i = 0; i<channels; i++) {
-
-            // Check if gate is open
-            bool gated = inputs[GATE_INPUT].getVoltage(i) >= 1.0f;
-
-            // Check if triggered
-            if (trigger[i].process(inputs[RETR_INPUT].getVoltage(i)))
-                decaying[i] = false;
-
-            const float base = 20000.0f;
-            const float maxTime = 10.0f;
-
-            // if gate is open, generate envelope signal
-            if (gated) {
-                if (decaying[i]) {
-                    // Decay
-                    if (decay < 1e-4) {
-                        env[i] = sustain;
-                    } else {
-                        env[i] += powf(base, 1 - decay) / maxTime * (sustain - env[i]) / args.sampleRate;
-                    }
-                } else {
-                    // Attack
-                    // Skip ahead if attack is all the way down (infinitely fast)
-                    if (attack < 1e-4) {
-                        env[i] = 1.0f;
-                    } else {
-                        env[i] += powf(base, 1 - attack) / maxTime * (1.01 - env[i]) / args.sampleRate;
-                    }
-                    if (env[i] >= 1.0f) {
-                        env[i] = 1.0f;
-                        decaying[i] = true;
-                    }
-                }
-            } else {
-                // Release
-                if (release < 1e-4) {
-                    env[i] = 0.0f;
-                } else {
-                    env[i] += powf(base, 1 - release) / maxTime * (0.0 - env[i]) / args.sampleRate;
-                }
-                decaying[i] = false;
+            float_4 changed = opened | closed;
+            if (simd::movemask(changed)) {
+                stage[bank] = simd::ifelse(opened, float(ATTACK_STAGE), simd::ifelse(closed, float(RELEASE_STAGE), stage[bank]));
+                elapsed[bank] = simd::ifelse(changed, 0.f, elapsed[bank]);
+                startSegments(bank, changed);
             }
 
-            bool sustaining = isNear(env[i], sustain, 1e-3);
-            bool resting = isNear(env[i], 0.0, 1e-3);
+            env[bank] = env[bank] * multiplier[bank] + increment[bank];
+            elapsed[bank] += 1.f;
+
+            // Stages end after exactly their length in samples, landing on their target
+            float_4 ended = (elapsed[bank] >= stageLength(bank)) & ~holding(bank);
+            if (simd::movemask(ended)) {
+                env[bank] = simd::ifelse(ended, stageTarget(bank), env[bank]);
+                float_4 nextStage = simd::ifelse(stage[bank] == float(ATTACK_STAGE), float(DECAY_STAGE),
+                        simd::ifelse(stage[bank] == float(DECAY_STAGE), float(SUSTAIN_STAGE), float(IDLE_STAGE)));
+                stage[bank] = simd::ifelse(ended, nextStage, stage[bank]);
+                elapsed[bank] = simd::ifelse(ended, 0.f, elapsed[bank]);
+                startSegments(bank, ended);
 
-            outputs[OUT_OUTPUT].setVoltage(10.0f * env[i], i);
+                if (simd::movemask(stage[bank] != float(IDLE_STAGE)) == 0)
+                    idle[bank] = true;
+            }
 
-            // Lights
-            lights[ATCK_LIGHT].value = (gated && !decaying) ? 1.0f : 0.0f;
-            lights[DEC_LIGHT].value = (gated && decaying && !sustaining) ? 1.0f : 0.0f;
-            lights[SUS_LIGHT].value = (gated && decaying && sustaining) ? 1.0f : 0.0f;
-            lights[REL_LIGHT].value = (!gated && !resting) ? 1.0f : 0.0f;
+            outputs[OUT_OUTPUT].setVoltageSimd(10.f * env[bank], currentChannel);
         }
 	}
+
+    /*
+     * Process called only every 4 timesteps for performance optimization reasons.
+     * Updates the stage lengths of every channel and the lights
+     */
+    void processEvery4Samples(const ProcessArgs& args) {
+        channels = inputs[GATE_INPUT].getChannels();
+        currentBanks = (channels + 3) / 4;
+        outputs[OUT_OUTPUT].setChannels(channels);
+
+        float attackParam = params[ATCK_PARAM].getValue();
+        float decayParam = params[DEC_PARAM].getValue();
+        float sustainParam = params[SUS_PARAM].getValue();
+        float releaseParam = params[REL_PARAM].getValue();
+        float attackMod = params[ATCK_MOD_PARAM].getValue() / 10.f;
+        float decayMod = params[DEC_MOD_PARAM].getValue() / 10.f;
+        float sustainMod = params[SUS_MOD_PARAM].getValue() / 10.f;
+        float releaseMod = params[REL_MOD_PARAM].getValue() / 10.f;
+
+        bool curveChanged = curve != activeCurve;
+        activeCurve = curve;
+        bool reaim = reaimCounter-- == 0;
+        if (reaim)
+            reaimCounter = 63;
+
+        bool attackLight = false;
+        bool decayLight = false;
+        bool sustainLight = false;
+        bool releaseLight = false;
+
+        for (int bank = 0; bank < currentBanks; ++bank) {
+            const int currentChannel = bank * 4;
+
+            // Calculate parameter values
+            float_4 attack = simd::clamp(attackParam + inputs[ATCK_INPUT].getPolyVoltageSimd<float_4>(currentChannel) * attackMod, 0.f, 1.f);
+            float_4 decay = simd::clamp(decayParam + inputs[DEC_INPUT].getPolyVoltageSimd<float_4>(currentChannel) * decayMod, 0.f, 1.f);
+            float_4 sustain = simd::clamp(sustainParam + inputs[SUS_INPUT].getPolyVoltageSimd<float_4>(currentChannel) * sustainMod, 0.f, 1.f);
+            float_4 release = simd::clamp(releaseParam + inputs[REL_INPUT].getPolyVoltageSimd<float_4>(currentChannel) * releaseMod, 0.f, 1.f);
+
+            float_4 newAttackLength = stageSamples(attack, args.sampleRate);
+            float_4 newDecayLength = stageSamples(decay, args.sampleRate);
+            float_4 newReleaseLength = stageSamples(release, args.sampleRate);
+
+            // Only recalculate the running segments when something changed
+            float_4 changed = (newAttackLength != attackLength[bank]) | (newDecayLength != decayLength[bank])
+                    | (newReleaseLength != releaseLength[bank]) | (sustain != sustainLevel[bank]);
+            attackLength[bank] = newAttackLength;
+            decayLength[bank] = newDecayLength;
+            releaseLength[bank] = newReleaseLength;
+            sustainLevel[bank] = sustain;
+            if (simd::movemask(changed) || curveChanged || reaim)
+                startSegments(bank, float_4::mask());
+
+            // Lights show the stages any of the channels are in
+            attackLight |= simd::movemask(stage[bank] == float(ATTACK_STAGE)) != 0;
+            decayLight |= simd::movemask(stage[bank] == float(DECAY_STAGE)) != 0;
+            sustainLight |= simd::movemask(stage[bank] == float(SUSTAIN_STAGE)) != 0;
+            releaseLight |= simd::movemask(stage[bank] == float(RELEASE_STAGE)) != 0;
+        }
+
+        lights[ATCK_LIGHT].setBrightness(attackLight ? 1.f : 0.f);
+        lights[DEC_LIGHT].setBrightness(decayLight ? 1.f : 0.f);
+        lights[SUS_LIGHT].setBrightness(sustainLight ? 1.f : 0.f);
+        lights[REL_LIGHT].setBrightness(releaseLight ? 1.f : 0.f);
+    }
+
+    /*
+     * Length of a stage in samples, from 0.5 ms with the knob down to 10 s with the knob up
+     */
+    static float_4 stageSamples(float_4 x, float sampleRate) {
+        const float log2Base = std::log2(20000.0f);
+        const float maxTime = 10.0f;
+
+        float_4 time = dsp::approxExp2_taylor5<float_4>((x - 1.f) * log2Base) * maxTime;
+        return simd::fmax(simd::floor(time * sampleRate + 0.5f), 1.f);
+    }
+
+    /*
+     * Mask of the channels holding a level instead of moving towards a target
+     */
+    float_4 holding(int bank) {
+        return (stage[bank] == float(SUSTAIN_STAGE)) | (stage[bank] == float(IDLE_STAGE));
+    }
+
+    float_4 stageLength(int bank) {
+        return simd::ifelse(stage[bank] == float(ATTACK_STAGE), attackLength[bank],
+                simd::ifelse(stage[bank] == float(DECAY_STAGE), decayLength[bank],
+                simd::ifelse(stage[bank] == float(RELEASE_STAGE), releaseLength[bank], 1.f)));
+    }
+
+    float_4 stageTarget(int bank) {
+        return simd::ifelse(stage[bank] == float(ATTACK_STAGE), 1.f,
+                simd::ifelse((stage[bank] == float(DECAY_STAGE)) | (stage[bank] == float(SUSTAIN_STAGE)), sustainLevel[bank], 0.f));
+    }
+
+    /*
+     * Calculate the segment constants of the masked channels so they reach the stage target after the
+     * rest of the stage length. Exponential curves keep the multiplier of the full stage length and
+     * solve for the level they aim at, which also keeps their shape when the length changes midway.
+     */
+    void startSegments(int bank, float_4 mask) {
+        float_4 length = stageLength(bank);
+        float_4 target = stageTarget(bank);
+        float_4 remaining = simd::fmax(length - elapsed[bank], 1.f);
+
+        float_4 newMultiplier;
+        float_4 newIncrement;
+        float curvature = curveCurvature[activeCurve];
+        if (curvature == 0.f) {
+            newMultiplier = 1.f;
+            newIncrement = (target - env[bank]) / remaining;
+        }
+        else {
+            const float log2e = 1.44269504f;
+            newMultiplier = dsp::approxExp2_taylor5<float_4>(-curvature * log2e / length);
+            float_4 remainingRatio = dsp::approxExp2_taylor5<float_4>(-curvature * log2e * remaining / length);
+            float_4 aim = (target - env[bank] * remainingRatio) / (1.f - remainingRatio);
+            newIncrement = aim * (1.f - newMultiplier);
+        }
+
+        // Sustain and idle channels sit on their target
+        float_4 hold = holding(bank);
+        newMultiplier = simd::ifelse(hold, 0.f, newMultiplier);
+        newIncrement = simd::ifelse(hold, target, newIncrement);
+
+        multiplier[bank] = simd::ifelse(mask, newMultiplier, multiplier[bank]);
+        increment[bank] = simd::ifelse(mask, newIncrement, increment[bank]);
+    }
 };
 
 
@@ -179,6 +343,16 @@ struct ADSRWidget : ModuleWidget {
 		addChild(createLightCentered<MediumLight<YellowLight>>(mm2px(Vec(28.179, 13.085)), module, ADSR::SUS_LIGHT));
 		addChild(createLightCentered<MediumLight<YellowLight>>(mm2px(Vec(38.852, 13.085)), module, ADSR::REL_LIGHT));
 	}
+
+    /*
+     * Add the curve shape setting to module context window
+     */
+    void appendContextMenu(Menu* menu) override {
+        ADSR* module = getModule<ADSR>();
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createIndexPtrSubmenuItem("Curve", std::vector<std::string>(curveNames, curveNames + numCurves), &module->curve));
+    }
 };
 
 
@@ -1,6 +1,22 @@
 #include "plugin.hpp"
+#include "filters.hpp"
 
+using float_4 = simd::float_4;
+const int maxPolyphony = 16;
+const int maxBanks = maxPolyphony / 4;
 
+// Frequencies of the six square oscillators of the 808 cymbal and hihat, packed in two banks of four.
+// The last two lanes of the second bank are silent.
+const float_4 metalFrequencies[2] = {float_4(205.3f, 304.4f, 369.6f, 522.7f), float_4(540.f, 800.f, 0.f, 0.f)};
+const float_4 metalLevels[2] = {float_4(1.f / 6.f), float_4(1.f / 6.f, 1.f / 6.f, 0.f, 0.f)};
+
+
+/*
+ * Hihat module implementation.
+ * Six detuned square oscillators are shared by all voices, every voice filters them through its own band pass and high pass.
+ * A hat rings with the decay setting while its gate is held and is choked as soon as the gate falls,
+ * so short triggers play a closed hat and long gates an open one.
+ */
 struct HATS : Module {
 	enum ParamId {
 		CUTOFF_PARAM,
@@ -24,21 +40,146 @@ struct HATS : Module {
 		LIGHTS_LEN
 	};
 
+    // Shared square oscillators
+    float_4 metalPhase[2] = {};
+    float_4 metalAdvance[2] = {};
+
+    // Voice state, the envelope is multiplied by its decay every sample
+    float_4 envelope[maxBanks] = {};
+    TBiquad<float_4> bandpass[maxBanks];
+    TBiquad<float_4> highpass[maxBanks];
+    dsp::TSchmittTrigger<float_4> gateTrigger[maxBanks];
+    dsp::TSchmittTrigger<float_4> retriggerTrigger[maxBanks];
+
+    // Banks without a sounding hat skip processing, the oscillators stop when every bank is idle
+    bool idle[maxBanks] = {true, true, true, true};
+
+    // Per channel coefficients, updated every 4 samples
+    float_4 openDecay[maxBanks] = {};
+    float_4 closedDecay[maxBanks] = {};
+    float lastSampleTime = 0.f;
+
+    int channels = 1;
+    int currentBanks = 1;
+    int loopCounter = 0;
+
 	HATS() {
 		config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
-		configParam(CUTOFF_PARAM, 0.f, 1.f, 0.f, "");
-		configParam(DECAY_PARAM, 0.f, 1.f, 0.f, "");
-		configParam(CUTOFF_MOD_PARAM, 0.f, 1.f, 0.f, "");
-		configParam(DECAY_MOD_PARAM, 0.f, 1.f, 0.f, "");
-		configInput(CUTOFF_INPUT, "");
-		configInput(DECAY_INPUT, "");
-		configInput(GATE_INPUT, "");
-		configInput(RETR_INPUT, "");
-		configOutput(OUT_OUTPUT, "");
+		configParam(CUTOFF_PARAM, 0.f, 1.f, 0.5f, "Cutoff", " Hz", 6.f, 2000.f);
+		configParam(DECAY_PARAM, 0.f, 1.f, 0.5f, "Decay", " ms", 25.f, 40.f);
+		configParam(CUTOFF_MOD_PARAM, -1.f, 1.f, 0.f, "Cutoff modulation", "%", 0.f, 100.f);
+		configParam(DECAY_MOD_PARAM, -1.f, 1.f, 0.f, "Decay modulation", "%", 0.f, 100.f);
+		configInput(CUTOFF_INPUT, "Cutoff modulation");
+		configInput(DECAY_INPUT, "Decay modulation");
+		configInput(GATE_INPUT, "Gate");
+		configInput(RETR_INPUT, "Retrigger");
+		configOutput(OUT_OUTPUT, "Hihat");
 	}
 
+    /*
+     * Process a single timestep
+     */
 	void process(const ProcessArgs& args) override {
+        if (loopCounter-- == 0) {
+            loopCounter = 3;
+            processEvery4Samples(args);
+        }
+
+        bool metalComputed = false;
+        float_4 metal = 0.f;
+        for (int bank = 0; bank < currentBanks; ++bank) {
+            const int currentChannel = bank * 4;
+
+            // rising edges of the gate or retrigger start a new hit, a held gate keeps it open
+            float_4 gate = inputs[GATE_INPUT].getPolyVoltageSimd<float_4>(currentChannel);
+            float_4 triggered = gateTrigger[bank].process(gate)
+                    | retriggerTrigger[bank].process(inputs[RETR_INPUT].getPolyVoltageSimd<float_4>(currentChannel));
+            if (idle[bank]) {
+                if (simd::movemask(triggered) == 0)
+                    continue;
+                idle[bank] = false;
+                updateCoefficients(bank, args);
+            }
+            envelope[bank] = simd::ifelse(triggered, 1.f, envelope[bank]);
+
+            // the oscillators only run while a hat is sounding
+            if (!metalComputed) {
+                metal = processMetal();
+                metalComputed = true;
+            }
+
+            float_4 out = highpass[bank].process(bandpass[bank].process(metal)) * envelope[bank];
+            envelope[bank] *= simd::ifelse(gate >= 1.f, openDecay[bank], closedDecay[bank]);
+
+            // hats below -80 dB are done
+            if (simd::movemask(envelope[bank] > 1e-4f) == 0) {
+                idle[bank] = true;
+                outputs[OUT_OUTPUT].setVoltageSimd(float_4::zero(), currentChannel);
+                continue;
+            }
+
+            outputs[OUT_OUTPUT].setVoltageSimd(20.f * out, currentChannel);
+        }
 	}
+
+    /*
+     * Advance the six square oscillators and return their mix in every lane
+     */
+    float_4 processMetal() {
+        float mix = 0.f;
+        for (int i = 0; i < 2; ++i) {
+            metalPhase[i] += metalAdvance[i];
+            metalPhase[i] -= simd::floor(metalPhase[i]);
+            float_4 square = simd::ifelse(metalPhase[i] < 0.5f, metalLevels[i], -metalLevels[i]);
+            mix += square[0] + square[1] + square[2] + square[3];
+        }
+        return float_4(mix);
+    }
+
+    /*
+     * Process called only every 4 timesteps for performance optimization reasons.
+     * Updates decays and filters of every channel
+     */
+    void processEvery4Samples(const ProcessArgs& args) {
+        channels = std::max(std::max(inputs[GATE_INPUT].getChannels(), inputs[RETR_INPUT].getChannels()), 1);
+        currentBanks = (channels + 3) / 4;
+        outputs[OUT_OUTPUT].setChannels(channels);
+
+        if (args.sampleTime != lastSampleTime) {
+            lastSampleTime = args.sampleTime;
+            for (int i = 0; i < 2; ++i) {
+                metalAdvance[i] = metalFrequencies[i] * args.sampleTime;
+            }
+        }
+
+        for (int bank = 0; bank < currentBanks; ++bank) {
+            if (!idle[bank])
+                updateCoefficients(bank, args);
+        }
+    }
+
+    /*
+     * Calculate decays and filter coefficients of the channels of a bank
+     */
+    void updateCoefficients(int bank, const ProcessArgs& args) {
+        const int currentChannel = bank * 4;
+        float decayParam = params[DECAY_PARAM].getValue();
+        float cutoffParam = params[CUTOFF_PARAM].getValue();
+        float decayMod = params[DECAY_MOD_PARAM].getValue() / 10.f;
+        float cutoffMod = params[CUTOFF_MOD_PARAM].getValue() / 10.f;
+
+        // open hats ring 40 ms to 1 s, closed hats are choked within 40 ms
+        float_4 decay = simd::clamp(decayParam + inputs[DECAY_INPUT].getPolyVoltageSimd<float_4>(currentChannel) * decayMod, 0.f, 1.f);
+        float_4 decayTime = 0.04f * simd::pow(25.f, decay);
+        openDecay[bank] = simd::exp(-args.sampleTime / decayTime);
+        closedDecay[bank] = simd::fmin(openDecay[bank], std::exp(-args.sampleTime / 0.04f));
+
+        // band pass centre from 2 kHz to 12 kHz, the high pass sits below it to take away the low end of the squares
+        float_4 cutoff = simd::clamp(cutoffParam + inputs[CUTOFF_INPUT].getPolyVoltageSimd<float_4>(currentChannel) * cutoffMod, 0.f, 1.f);
+        float_4 cutoffFreq = simd::fmin(2000.f * simd::pow(6.f, cutoff), 0.45f * args.sampleRate);
+        bandpass[bank].setParametersBand(cutoffFreq * args.sampleTime, 1.5f);
+        highpass[bank].setParametersHigh(0.75f * cutoffFreq * args.sampleTime);
+    }
 };
 
 
@@ -1,6 +1,38 @@
 #include "plugin.hpp"
+#include "noise.hpp"
 
+using float_4 = simd::float_4;
+const int maxPolyphony = 16;
+const int maxBanks = maxPolyphony / 4;
 
+/*
+ * Simd sine approximation
+ */
+inline float_4 sinTwoPi(float_4 _x) {
+    const static float twoPi = 2 * 3.141592653589793238;
+    const static float pi =  3.141592653589793238;
+    _x -= ifelse((_x > float_4(pi)), float_4(twoPi), float_4::zero());
+
+    float_4 xneg = _x < float_4::zero();
+    float_4 xOffset = ifelse(xneg, float_4(pi / 2.f), float_4(-pi  / 2.f));
+    xOffset += _x;
+    float_4 xSquared = xOffset * xOffset;
+    float_4 ret = xSquared * float_4(1.f / 24.f);
+    float_4 correction = ret * xSquared *  float_4(.02 / .254);
+    ret += float_4(-.5);
+    ret *= xSquared;
+    ret += float_4(1.f);
+
+    ret -= correction;
+    return ifelse(xneg, -ret, ret);
+}
+
+
+/*
+ * Kick drum module implementation.
+ * A sine body that sweeps down from two octaves above its pitch, a short noise click and a two pole lowpass.
+ * Polyphonic, every channel of the gate or retrigger input plays its own kick.
+ */
 struct KICKS : Module {
 	enum ParamId {
 		FREQ_PARAM,
@@ -27,24 +59,152 @@ struct KICKS : Module {
 		LIGHTS_LEN
 	};
 
+    // Voice state, the envelopes are multiplied by their decay every sample
+    float_4 phase[maxBanks] = {};
+    float_4 amplitudeEnvelope[maxBanks] = {};
+    float_4 pitchEnvelope[maxBanks] = {};
+    float_4 clickEnvelope[maxBanks] = {};
+    float_4 lowpass1[maxBanks] = {};
+    float_4 lowpass2[maxBanks] = {};
+    dsp::TSchmittTrigger<float_4> gateTrigger[maxBanks];
+    dsp::TSchmittTrigger<float_4> retriggerTrigger[maxBanks];
+    NoiseGenerator4 noise[maxBanks];
+
+    // Banks without a sounding kick skip processing
+    bool idle[maxBanks] = {true, true, true, true};
+
+    // Per channel coefficients, updated every 4 samples
+    float_4 phaseAdvance[maxBanks] = {};
+    float_4 amplitudeDecay[maxBanks] = {};
+    float_4 lowpassCoefficient[maxBanks] = {};
+    float pitchDecay = 0.f;
+    float clickDecay = 0.f;
+    float lastSampleTime = 0.f;
+
+    int channels = 1;
+    int currentBanks = 1;
+    int loopCounter = 0;
+
 	KICKS() {
 		config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
-		configParam(FREQ_PARAM, 0.f, 1.f, 0.f, "");
-		configParam(FM_MOD_PARAM, 0.f, 1.f, 0.f, "");
-		configParam(DECAY_MOD_PARAM, 0.f, 1.f, 0.f, "");
-		configParam(CUTOFF_PARAM, 0.f, 1.f, 0.f, "");
-		configParam(DECAY_PARAM, 0.f, 1.f, 0.f, "");
-		configParam(CUTOFF_MOD_PARAM, 0.f, 1.f, 0.f, "");
-		configInput(FM_INPUT, "");
-		configInput(DECAY_INPUT, "");
-		configInput(CUTOFF_INPUT, "");
-		configInput(GATE_INPUT, "");
-		configInput(RETR_INPUT, "");
-		configOutput(OUT_OUTPUT, "");
+		configParam(FREQ_PARAM, 0.f, 1.f, 0.5f, "Frequency", " Hz", 4.f, 30.f);
+		configParam(FM_MOD_PARAM, -1.f, 1.f, 0.f, "Frequency modulation", "%", 0.f, 100.f);
+		configParam(DECAY_MOD_PARAM, -1.f, 1.f, 0.f, "Decay modulation", "%", 0.f, 100.f);
+		configParam(CUTOFF_PARAM, 0.f, 1.f, 0.5f, "Cutoff", " Hz", 100.f, 100.f);
+		configParam(DECAY_PARAM, 0.f, 1.f, 0.5f, "Decay", " ms", 40.f, 50.f);
+		configParam(CUTOFF_MOD_PARAM, -1.f, 1.f, 0.f, "Cutoff modulation", "%", 0.f, 100.f);
+		configInput(FM_INPUT, "Frequency modulation (V/oct)");
+		configInput(DECAY_INPUT, "Decay modulation");
+		configInput(CUTOFF_INPUT, "Cutoff modulation");
+		configInput(GATE_INPUT, "Gate");
+		configInput(RETR_INPUT, "Retrigger");
+		configOutput(OUT_OUTPUT, "Kick");
+
+		for (int bank = 0; bank < maxBanks; ++bank) {
+		    noise[bank].seed(random::u32(), bank * 4);
+		}
 	}
 
+    /*
+     * Process a single timestep
+     */
 	void process(const ProcessArgs& args) override {
+        if (loopCounter-- == 0) {
+            loopCounter = 3;
+            processEvery4Samples(args);
+        }
+
+        const float twoPi = 2.f * M_PI;
+        for (int bank = 0; bank < currentBanks; ++bank) {
+            const int currentChannel = bank * 4;
+
+            // rising edges of the gate or retrigger start a new kick
+            float_4 triggered = gateTrigger[bank].process(inputs[GATE_INPUT].getPolyVoltageSimd<float_4>(currentChannel))
+                    | retriggerTrigger[bank].process(inputs[RETR_INPUT].getPolyVoltageSimd<float_4>(currentChannel));
+            if (idle[bank]) {
+                if (simd::movemask(triggered) == 0)
+                    continue;
+                idle[bank] = false;
+                updateCoefficients(bank, args);
+            }
+            phase[bank] = simd::ifelse(triggered, 0.f, phase[bank]);
+            amplitudeEnvelope[bank] = simd::ifelse(triggered, 1.f, amplitudeEnvelope[bank]);
+            pitchEnvelope[bank] = simd::ifelse(triggered, 1.f, pitchEnvelope[bank]);
+            clickEnvelope[bank] = simd::ifelse(triggered, 1.f, clickEnvelope[bank]);
+
+            // body sweeps down from two octaves up
+            phase[bank] += phaseAdvance[bank] * (1.f + 3.f * pitchEnvelope[bank]);
+            phase[bank] -= simd::floor(phase[bank]);
+            float_4 body = sinTwoPi(twoPi * phase[bank]) * amplitudeEnvelope[bank];
+            float_4 click = noise[bank].uniform() * clickEnvelope[bank] * 0.5f;
+
+            lowpass1[bank] += lowpassCoefficient[bank] * (body + click - lowpass1[bank]);
+            lowpass2[bank] += lowpassCoefficient[bank] * (lowpass1[bank] - lowpass2[bank]);
+
+            amplitudeEnvelope[bank] *= amplitudeDecay[bank];
+            pitchEnvelope[bank] *= pitchDecay;
+            clickEnvelope[bank] *= clickDecay;
+
+            // kicks below -80 dB are done
+            if (simd::movemask(amplitudeEnvelope[bank] > 1e-4f) == 0) {
+                idle[bank] = true;
+                lowpass1[bank] = lowpass2[bank] = 0.f;
+                outputs[OUT_OUTPUT].setVoltageSimd(float_4::zero(), currentChannel);
+                continue;
+            }
+
+            outputs[OUT_OUTPUT].setVoltageSimd(5.f * lowpass2[bank], currentChannel);
+        }
 	}
+
+    /*
+     * Process called only every 4 timesteps for performance optimization reasons.
+     * Updates pitch, decay and cutoff of every channel
+     */
+    void processEvery4Samples(const ProcessArgs& args) {
+        channels = std::max(std::max(inputs[GATE_INPUT].getChannels(), inputs[RETR_INPUT].getChannels()), 1);
+        currentBanks = (channels + 3) / 4;
+        outputs[OUT_OUTPUT].setChannels(channels);
+
+        // the sweep and click are fixed at 30 ms and 2 ms
+        if (args.sampleTime != lastSampleTime) {
+            lastSampleTime = args.sampleTime;
+            pitchDecay = std::exp(-args.sampleTime / 0.03f);
+            clickDecay = std::exp(-args.sampleTime / 0.002f);
+        }
+
+        for (int bank = 0; bank < currentBanks; ++bank) {
+            if (!idle[bank])
+                updateCoefficients(bank, args);
+        }
+    }
+
+    /*
+     * Calculate pitch, decay and cutoff of the channels of a bank
+     */
+    void updateCoefficients(int bank, const ProcessArgs& args) {
+        const int currentChannel = bank * 4;
+        float freqParam = params[FREQ_PARAM].getValue();
+        float decayParam = params[DECAY_PARAM].getValue();
+        float cutoffParam = params[CUTOFF_PARAM].getValue();
+        float fmMod = params[FM_MOD_PARAM].getValue();
+        float decayMod = params[DECAY_MOD_PARAM].getValue() / 10.f;
+        float cutoffMod = params[CUTOFF_MOD_PARAM].getValue() / 10.f;
+
+        // 30 Hz to 120 Hz, the frequency modulation input is in V/oct
+        float_4 pitch = freqParam * 2.f + inputs[FM_INPUT].getPolyVoltageSimd<float_4>(currentChannel) * fmMod;
+        phaseAdvance[bank] = 30.f * dsp::approxExp2_taylor5<float_4>(pitch) * args.sampleTime;
+
+        // 50 ms to 2 s
+        float_4 decay = simd::clamp(decayParam + inputs[DECAY_INPUT].getPolyVoltageSimd<float_4>(currentChannel) * decayMod, 0.f, 1.f);
+        float_4 decayTime = 0.05f * simd::pow(40.f, decay);
+        amplitudeDecay[bank] = simd::exp(-args.sampleTime / decayTime);
+
+        // 100 Hz to 10 kHz
+        float_4 cutoff = simd::clamp(cutoffParam + inputs[CUTOFF_INPUT].getPolyVoltageSimd<float_4>(currentChannel) * cutoffMod, 0.f, 1.f);
+        float_4 cutoffFreq = simd::fmin(100.f * simd::pow(100.f, cutoff), 0.45f * args.sampleRate);
+        lowpassCoefficient[bank] = 1.f - simd::exp(-2.f * float(M_PI) * cutoffFreq * args.sampleTime);
+    }
 };
 
 
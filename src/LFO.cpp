@@ -3,6 +3,8 @@
 #include "stdio.h"
 
 using float_4 = simd::float_4;
+static const int maxPolyphony = 16;
+static const int maxBanks = maxPolyphony / 4;
 
 /*
  * Simd sine approximation
@@ -29,6 +31,7 @@ inline float_4 sinTwoPi(float_4 _x) {
 /*
  * Low frequency oscillator module implementation.
  * Provides, sine, square, saw and triangle waves from 0-1024Hz
+ * Polyphonic, every channel has its own frequency modulation, reset and phase offset.
  */
 struct LFO : Module {
 	enum ParamId {
@@ -37,6 +40,8 @@ struct LFO : Module {
 		FM_PARAM,
 		OFST_PARAM,
 		PULSEMOD_PARAM,
+		CHANNELS_PARAM,
+		SPREAD_PARAM,
 		PARAMS_LEN
 	};
 	enum InputId {
@@ -56,17 +61,47 @@ struct LFO : Module {
 		LIGHTS_LEN
 	};
 
-    float_4 phaseAccumulator = 0;
-    float_4 phaseAdvance = 0;
+    float_4 phaseAccumulators[maxBanks] = {};
+    float_4 phaseAdvance[maxBanks] = {};
+    float_4 pulsewidth[maxBanks] = {};
+
+    // Phase offset of every channel, spread evenly or random
+    float_4 phaseOffsets[maxBanks] = {};
+    float_4 randomOffsets[maxBanks] = {};
+    bool randomPhase = false;
 
-    float pulsewidth = 1.f;
     float offset = 0.f;
+    int currentPolyphony = 1;
     int currentBanks = 1;
     int loopCounter = 0;
-    bool outputSaw = false;
-    bool outputSin = false;
-    bool outputSqr = false;
-    bool outputTri = false;
+
+    // Connected outputs, the output kernel is specialized for every combination of them
+    enum OutputMask {
+        SAW_MASK = 1 << 0,
+        SQR_MASK = 1 << 1,
+        SIN_MASK = 1 << 2,
+        TRI_MASK = 1 << 3
+    };
+    typedef void (LFO::*OutputKernel)();
+    int outputMask = 0;
+    OutputKernel outputKernel = &LFO::generateOutputKernel<0>;
+
+    // At slow rates sine and triangle are evaluated only every decimation samples and linearly interpolated
+    // in between, square and saw stay exact to the sample for clock and gate use
+    static const int decimation = 32;
+    static const int decimatedMask = SIN_MASK | TRI_MASK;
+    bool decimate = false;
+    bool restartSegment = true;
+    int segmentSamples = 0;
+    float_4 segmentValues[maxBanks][OUTPUTS_LEN] = {};
+    float_4 segmentIncrements[maxBanks][OUTPUTS_LEN] = {};
+    float_4 segmentTargets[maxBanks][OUTPUTS_LEN] = {};
+
+    // A single channel packs its four waveforms into the lanes of one vector, in output order
+    const float_4 outputLanes = float_4(0.f, 1.f, 2.f, 3.f);
+    float_4 monoValue = 0.f;
+    float_4 monoIncrement = 0.f;
+    float_4 monoTarget = 0.f;
 
 
 	LFO() {
@@ -76,6 +111,8 @@ struct LFO : Module {
 		configParam(FM_PARAM, -1.f, 1.f, 0.f, "Frequency modulation", "%", 0.f, 100.f);
 		configSwitch(OFST_PARAM, 0.f, 1.f, 0.f, "Offset");
 		configParam(PULSEMOD_PARAM, -1.f, 1.f, 0.f, "Pulsewidth modulation", "%", 0.f, 100.f);
+		configParam(CHANNELS_PARAM, 1.f, maxPolyphony, 1.f, "Polyphony channels")->snapEnabled = true;
+		configParam(SPREAD_PARAM, 0.f, 1.f, 0.f, "Phase spread", "%", 0.f, 100.f);
 		configInput(FM_INPUT, "Frequency modulation");
 		configInput(RESET_INPUT, "Reset");
 		configInput(PULSEMOD_INPUT, "Pulsewidth modulation");
@@ -83,8 +120,32 @@ struct LFO : Module {
 		configOutput(TRIANGLE_OUTPUT, "Triangle output");
 		configOutput(SAW_OUTPUT, "Saw output");
 		configOutput(SQUARE_OUTPUT, "Square output");
+		randomizeOffsets();
 	}
 
+    json_t* dataToJson() override {
+        json_t* rootJ = json_object();
+        json_object_set_new(rootJ, "randomPhase", json_boolean(randomPhase));
+        return rootJ;
+    }
+
+    void dataFromJson(json_t* rootJ) override {
+        json_t* randomPhaseJ = json_object_get(rootJ, "randomPhase");
+        if (randomPhaseJ)
+            randomPhase = json_boolean_value(randomPhaseJ);
+    }
+
+    /*
+     * Pick a new random phase offset for every channel
+     */
+    void randomizeOffsets() {
+        for (int bank = 0; bank < maxBanks; ++bank) {
+            for (int lane = 0; lane < 4; ++lane) {
+                randomOffsets[bank][lane] = random::uniform();
+            }
+        }
+    }
+
     /*
      * Process a single timestep
      */
@@ -102,13 +163,25 @@ struct LFO : Module {
      * Mostly consists of updating parameters and calculating output frequency
      */
     void processEvery4Samples(const ProcessArgs& args) {
-        outputSaw = outputs[SAW_OUTPUT].isConnected();
-        outputSin = outputs[SINE_OUTPUT].isConnected();
-        outputSqr = outputs[SQUARE_OUTPUT].isConnected();
-        outputTri = outputs[TRIANGLE_OUTPUT].isConnected();
+        int newOutputMask = (outputs[SAW_OUTPUT].isConnected() ? SAW_MASK : 0)
+                | (outputs[SQUARE_OUTPUT].isConnected() ? SQR_MASK : 0)
+                | (outputs[SINE_OUTPUT].isConnected() ? SIN_MASK : 0)
+                | (outputs[TRIANGLE_OUTPUT].isConnected() ? TRI_MASK : 0);
+
+        // The channel count follows the frequency modulation input, or the channels setting if that is higher
+        int newPolyphony = std::max((int) params[CHANNELS_PARAM].getValue(), inputs[FM_INPUT].getChannels());
+        if (newPolyphony != currentPolyphony)
+            restartSegment = true;
+        currentPolyphony = newPolyphony;
+        currentBanks = (currentPolyphony + 3) / 4;
+        outputs[SINE_OUTPUT].setChannels(currentPolyphony);
+        outputs[TRIANGLE_OUTPUT].setChannels(currentPolyphony);
+        outputs[SAW_OUTPUT].setChannels(currentPolyphony);
+        outputs[SQUARE_OUTPUT].setChannels(currentPolyphony);
 
         float pulseWidthParam = params[PULSE_PARAM].getValue();
         float pulseModParam = params[PULSEMOD_PARAM].getValue();
+        float spread = params[SPREAD_PARAM].getValue();
 
         // Set offset
         if (params[OFST_PARAM].getValue() > 0.f) {
@@ -118,76 +191,268 @@ struct LFO : Module {
             offset = 0.f;
         }
 
-        // Set pulsewidth
-        pulsewidth = pulseWidthParam + inputs[PULSEMOD_INPUT].getVoltage() / 10.f * pulseModParam;
-        pulsewidth = clamp(pulsewidth, 0.01f, 1.f - 0.01f);
-
         // Note that assigning a float to a float_4 silently copies the float into all
         // four floats in the float_4.
         float_4 pitchParam = params[FREQ_PARAM].value;
         float fmParam = params[FM_PARAM].getValue();
-        const int currentChannel = 1;
+        const float_4 q = float(std::log2(261.626));       // move up to C
+        float_4 maxAdvance = 0.f;
 
-        float_4 combinedPitch = pitchParam - float_4(4.f);
+        for (int bank = 0; bank < currentBanks; ++bank) {
+            const int currentChannel = bank * 4;
 
-        const float_4 q = float(std::log2(261.626));       // move up to C
-        combinedPitch += q;
-        combinedPitch += inputs[FM_INPUT].getPolyVoltageSimd<float_4>(currentChannel) * fmParam;
+            // Set pulsewidth
+            float_4 pulseCV = inputs[PULSEMOD_INPUT].getPolyVoltageSimd<float_4>(currentChannel);
+            pulsewidth[bank] = simd::clamp(pulseWidthParam + pulseCV / 10.f * pulseModParam, 0.01f, 1.f - 0.01f);
+
+            // Set phase offset, channels are spread evenly over the spread fraction of a cycle
+            if (randomPhase) {
+                phaseOffsets[bank] = randomOffsets[bank];
+            }
+            else {
+                float_4 channel = float_4(0.f, 1.f, 2.f, 3.f) + float_4(currentChannel);
+                phaseOffsets[bank] = channel * (spread / currentPolyphony);
+            }
 
+            float_4 combinedPitch = pitchParam - float_4(4.f);
+            combinedPitch += q;
+            combinedPitch += inputs[FM_INPUT].getPolyVoltageSimd<float_4>(currentChannel) * fmParam;
 
-        const float_4 freq = rack::dsp::approxExp2_taylor5<float_4>(combinedPitch);
+            const float_4 freq = rack::dsp::approxExp2_taylor5<float_4>(combinedPitch);
 
-        const float_4 normalizedFreq = float_4(args.sampleTime) * freq;
-        phaseAdvance = normalizedFreq;
+            const float_4 normalizedFreq = float_4(args.sampleTime) * freq;
+            phaseAdvance[bank] = normalizedFreq;
+            maxAdvance = simd::fmax(maxAdvance, normalizedFreq);
+        }
 
+        // Interpolate as long as a cycle spans at least 32 segments, in the audio range evaluate every sample
+        bool newDecimate = simd::movemask(maxAdvance * float(decimation * 32) > 1.f) == 0;
+        if (newOutputMask != outputMask || newDecimate != decimate) {
+            outputMask = newOutputMask;
+            decimate = newDecimate;
+            outputKernel = getOutputKernel(outputMask, decimate);
+            restartSegment = true;
+        }
     }
 
     /*
      * Actually generate output signal
      */
     void generateOutput() {
-        // advance phase and wrap
-        phaseAccumulator += phaseAdvance;
-        phaseAccumulator -= simd::floor(phaseAccumulator);
-        if (inputs[RESET_INPUT].getVoltage() > 0.f) {
-            phaseAccumulator = 0;
+        for (int bank = 0; bank < currentBanks; ++bank) {
+            // advance phase and wrap
+            phaseAccumulators[bank] += phaseAdvance[bank];
+            phaseAccumulators[bank] -= simd::floor(phaseAccumulators[bank]);
+            float_4 reset = inputs[RESET_INPUT].getPolyVoltageSimd<float_4>(bank * 4);
+            phaseAccumulators[bank] = simd::ifelse(reset > 0.f, 0.f, phaseAccumulators[bank]);
         }
 
-        if (outputSaw) {
+        (this->*outputKernel)();
+    }
+
+    /*
+     * Look up the output kernel specialized for a combination of connected outputs,
+     * either evaluating every sample or interpolating sine and triangle between decimated evaluations
+     */
+    static OutputKernel getOutputKernel(int mask, bool decimate) {
+        static const OutputKernel kernels[16] = {
+            &LFO::generateOutputKernel<0>, &LFO::generateOutputKernel<1>, &LFO::generateOutputKernel<2>, &LFO::generateOutputKernel<3>,
+            &LFO::generateOutputKernel<4>, &LFO::generateOutputKernel<5>, &LFO::generateOutputKernel<6>, &LFO::generateOutputKernel<7>,
+            &LFO::generateOutputKernel<8>, &LFO::generateOutputKernel<9>, &LFO::generateOutputKernel<10>, &LFO::generateOutputKernel<11>,
+            &LFO::generateOutputKernel<12>, &LFO::generateOutputKernel<13>, &LFO::generateOutputKernel<14>, &LFO::generateOutputKernel<15>
+        };
+        static const OutputKernel decimatedKernels[16] = {
+            &LFO::generateDecimatedKernel<0>, &LFO::generateDecimatedKernel<1>, &LFO::generateDecimatedKernel<2>, &LFO::generateDecimatedKernel<3>,
+            &LFO::generateDecimatedKernel<4>, &LFO::generateDecimatedKernel<5>, &LFO::generateDecimatedKernel<6>, &LFO::generateDecimatedKernel<7>,
+            &LFO::generateDecimatedKernel<8>, &LFO::generateDecimatedKernel<9>, &LFO::generateDecimatedKernel<10>, &LFO::generateDecimatedKernel<11>,
+            &LFO::generateDecimatedKernel<12>, &LFO::generateDecimatedKernel<13>, &LFO::generateDecimatedKernel<14>, &LFO::generateDecimatedKernel<15>
+        };
+        return (decimate && (mask & decimatedMask)) ? decimatedKernels[mask] : kernels[mask];
+    }
+
+    /*
+     * Evaluate the connected waveforms of one bank at the given phase, indexed by output.
+     * MASK is known at compile time, so the checks on it leave no branches.
+     */
+    template <int MASK>
+    void evaluateWaveforms(int bank, float_4 phase, float_4* waves) {
+        // phase of every channel, including its offset
+        phase += phaseOffsets[bank];
+        phase -= simd::floor(phase);
+
+        if (MASK & SAW_MASK) {
             // generate raw saw signal
-            float_4 rawSaw = phaseAccumulator + float_4(.5f);
+            float_4 rawSaw = phase + float_4(.5f);
             rawSaw -= simd::trunc(rawSaw);
             rawSaw = 2 * rawSaw - 1;
 
-            // transform from -1v / 1v to -5v / 5v and send to output
-            float_4 sawWave = float_4(5) * rawSaw + float_4(offset);
-            outputs[SAW_OUTPUT].setVoltageSimd(sawWave, 0);
+            // transform from -1v / 1v to -5v / 5v
+            waves[SAW_OUTPUT] = float_4(5) * rawSaw + float_4(offset);
         }
 
-        if (outputSqr) {
+        if (MASK & SQR_MASK) {
             // generate raw square signal
-            float_4 rawSqr = simd::ifelse(phaseAccumulator < pulsewidth, 1.f, -1.f);
+            float_4 rawSqr = simd::ifelse(phase < pulsewidth[bank], 1.f, -1.f);
 
-            // transform from -1v / 1v to -5v / 5v and send to output
-            float_4 sqrWave = float_4(5) * rawSqr + float_4(offset);
-            outputs[SQUARE_OUTPUT].setVoltageSimd(sqrWave, 0);
+            // transform from -1v / 1v to -5v / 5v
+            waves[SQUARE_OUTPUT] = float_4(5) * rawSqr + float_4(offset);
         }
 
-        if (outputSin) {
+        if (MASK & SIN_MASK) {
             const static float twoPi = 2 * 3.141592653589793238;
-            float_4 sinWave = float_4(5.f) * sinTwoPi(phaseAccumulator * twoPi) + float_4(offset);
-            outputs[SINE_OUTPUT].setVoltageSimd(sinWave, 0);
+            waves[SINE_OUTPUT] = float_4(5.f) * sinTwoPi(phase * twoPi) + float_4(offset);
         }
 
-        if (outputTri) {
+        if (MASK & TRI_MASK) {
             // generate triangle wave based on saw wave
-            float_4 saw = (phaseAccumulator - 0.5) * 2;
+            float_4 saw = (phase - 0.5) * 2;
             float_4 triangle = (abs(saw) * 2) - 1;
+            waves[TRIANGLE_OUTPUT] = triangle * float_4(5) + float_4(offset);
+        }
+    }
+
+    /*
+     * Evaluate all four waveforms of a single channel at once, every lane holds the output of the same index.
+     * The saw lane runs half a cycle ahead so saw and triangle share one ramp. Sine and triangle are skipped
+     * when only the exact edges of saw and square are needed.
+     */
+    template <bool SMOOTH>
+    float_4 evaluatePacked(float_4 phase) {
+        phase += phaseOffsets[0][0];
+        phase -= simd::floor(phase);
+
+        float_4 ramp = phase + simd::ifelse(outputLanes == float(SAW_OUTPUT), 0.5f, 0.f);
+        ramp -= simd::floor(ramp);
+        ramp = 2.f * ramp - 1.f;
+
+        float_4 waves = simd::ifelse(outputLanes == float(SQUARE_OUTPUT), simd::ifelse(phase < pulsewidth[0][0], 1.f, -1.f), ramp);
+        if (SMOOTH) {
+            const static float twoPi = 2 * 3.141592653589793238;
+            waves = simd::ifelse(outputLanes == float(TRIANGLE_OUTPUT), 2.f * simd::abs(ramp) - 1.f, waves);
+            waves = simd::ifelse(outputLanes == float(SINE_OUTPUT), sinTwoPi(phase * twoPi), waves);
+        }
+
+        // transform from -1v / 1v to -5v / 5v
+        return float_4(5.f) * waves + float_4(offset);
+    }
+
+    /*
+     * Output the connected waveforms of a single channel from their packed lanes
+     */
+    template <int MASK>
+    void setPackedOutputs(float_4 waves) {
+        if (MASK & SAW_MASK)
+            outputs[SAW_OUTPUT].setVoltage(waves[SAW_OUTPUT]);
+        if (MASK & SQR_MASK)
+            outputs[SQUARE_OUTPUT].setVoltage(waves[SQUARE_OUTPUT]);
+        if (MASK & SIN_MASK)
+            outputs[SINE_OUTPUT].setVoltage(waves[SINE_OUTPUT]);
+        if (MASK & TRI_MASK)
+            outputs[TRIANGLE_OUTPUT].setVoltage(waves[TRIANGLE_OUTPUT]);
+    }
+
+    /*
+     * Generate the waveforms of one combination of connected outputs
+     */
+    template <int MASK>
+    void generateOutputKernel() {
+        if (currentPolyphony == 1) {
+            setPackedOutputs<MASK>(evaluatePacked<(MASK & decimatedMask) != 0>(phaseAccumulators[0][0]));
+            return;
+        }
+
+        for (int bank = 0; bank < currentBanks; ++bank) {
+            float_4 waves[4];
+            evaluateWaveforms<MASK>(bank, phaseAccumulators[bank], waves);
+
+            if (MASK & SAW_MASK)
+                outputs[SAW_OUTPUT].setVoltageSimd(waves[SAW_OUTPUT], bank * 4);
+            if (MASK & SQR_MASK)
+                outputs[SQUARE_OUTPUT].setVoltageSimd(waves[SQUARE_OUTPUT], bank * 4);
+            if (MASK & SIN_MASK)
+                outputs[SINE_OUTPUT].setVoltageSimd(waves[SINE_OUTPUT], bank * 4);
+            if (MASK & TRI_MASK)
+                outputs[TRIANGLE_OUTPUT].setVoltageSimd(waves[TRIANGLE_OUTPUT], bank * 4);
+        }
+    }
+
+    /*
+     * Start a new interpolation segment at the current phase: evaluate sine and triangle decimation samples
+     * ahead and ramp towards them. The ramp starts from the previous target, unless a reset or mode change
+     * makes that stale, then the waveforms are evaluated at the current phase.
+     */
+    template <int MASK>
+    void startSegment(bool restart) {
+        segmentSamples = 0;
+
+        // a single channel ramps all its waveforms in the lanes of one vector
+        if (currentPolyphony == 1) {
+            if (restart)
+                monoTarget = evaluatePacked<true>(phaseAccumulators[0][0]);
+            float_4 target = evaluatePacked<true>(phaseAccumulators[0][0] + phaseAdvance[0][0] * float(decimation));
+            monoValue = monoTarget;
+            monoIncrement = (target - monoTarget) * (1.f / decimation);
+            monoTarget = target;
+            return;
+        }
+
+        for (int bank = 0; bank < currentBanks; ++bank) {
+            if (restart)
+                evaluateWaveforms<MASK & decimatedMask>(bank, phaseAccumulators[bank], segmentTargets[bank]);
+
+            float_4 targets[4] = {};
+            evaluateWaveforms<MASK & decimatedMask>(bank, phaseAccumulators[bank] + phaseAdvance[bank] * float(decimation), targets);
 
-            // send to output
-            outputs[TRIANGLE_OUTPUT].setVoltageSimd(triangle * float_4(5) + float_4(offset), 0);
+            for (int output = 0; output < OUTPUTS_LEN; ++output) {
+                segmentValues[bank][output] = segmentTargets[bank][output];
+                segmentIncrements[bank][output] = (targets[output] - segmentTargets[bank][output]) * (1.f / decimation);
+                segmentTargets[bank][output] = targets[output];
+            }
         }
     }
+
+    /*
+     * Generate the waveforms of one combination of connected outputs, sine and triangle by evaluating them
+     * only every decimation samples and linearly interpolating in between, square and saw every sample
+     */
+    template <int MASK>
+    void generateDecimatedKernel() {
+        bool reset = false;
+        for (int bank = 0; bank < currentBanks; ++bank) {
+            reset |= simd::movemask(inputs[RESET_INPUT].getPolyVoltageSimd<float_4>(bank * 4) > 0.f) != 0;
+        }
+        if (reset || restartSegment || segmentSamples == decimation) {
+            startSegment<MASK>(reset || restartSegment);
+            restartSegment = false;
+        }
+        segmentSamples++;
+
+        if (currentPolyphony == 1) {
+            // interpolated sine and triangle lanes, saw and square lanes evaluated at the exact sample
+            float_4 edges = evaluatePacked<false>(phaseAccumulators[0][0]);
+            float_4 interpolated = (outputLanes == float(SINE_OUTPUT)) | (outputLanes == float(TRIANGLE_OUTPUT));
+            setPackedOutputs<MASK>(simd::ifelse(interpolated, monoValue, edges));
+            monoValue += monoIncrement;
+            return;
+        }
+
+        for (int bank = 0; bank < currentBanks; ++bank) {
+            float_4* values = segmentValues[bank];
+            const float_4* increments = segmentIncrements[bank];
+            if (MASK & SIN_MASK) {
+                outputs[SINE_OUTPUT].setVoltageSimd(values[SINE_OUTPUT], bank * 4);
+                values[SINE_OUTPUT] += increments[SINE_OUTPUT];
+            }
+            if (MASK & TRI_MASK) {
+                outputs[TRIANGLE_OUTPUT].setVoltageSimd(values[TRIANGLE_OUTPUT], bank * 4);
+                values[TRIANGLE_OUTPUT] += increments[TRIANGLE_OUTPUT];
+            }
+        }
+
+        // square edges and saw resets land on the exact sample
+        if (MASK & (SAW_MASK | SQR_MASK))
+            generateOutputKernel<MASK & (SAW_MASK | SQR_MASK)>();
+    }
 };
 
 
@@ -220,6 +485,22 @@ struct LFOWidget : ModuleWidget {
 		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(36.484, 108.95)), module, LFO::SAW_OUTPUT));
 		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(48.578, 108.95)), module, LFO::SQUARE_OUTPUT));
 	}
+
+    /*
+     * Add polyphony settings to module context window
+     */
+    void appendContextMenu(Menu* menu) override {
+        LFO* module = getModule<LFO>();
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createMenuLabel("Polyphony"));
+        menu->addChild(new GL_MenuSlider(module->paramQuantities[LFO::CHANNELS_PARAM]));
+        menu->addChild(new GL_MenuSlider(module->paramQuantities[LFO::SPREAD_PARAM]));
+        menu->addChild(createBoolPtrMenuItem("Random phase", "", &module->randomPhase));
+        menu->addChild(createMenuItem("New random phases", "", [=]() {
+            module->randomizeOffsets();
+        }));
+    }
 };
 
 
@@ -1,11 +1,26 @@
 #include "plugin.hpp"
+#include "noise.hpp"
 
-const float g_fScale = 2.0f / 0xffffffff;
+using float_4 = simd::float_4;
+const int maxPolyphony = 16;
+const int maxBanks = maxPolyphony / 4;
 
+// Leaky integrator of the red noise, and output levels that give the other noise types about 3 V rms
+const float redPole = 1.f / 1.02f;
+const float redGain = 0.02f / 1.02f;
+const float pinkLevel = 1.7f;
+const float redLevel = 52.f;
+const float gaussianLevel = 3.f;
 
 
+/*
+ * Noise module implementation
+ * Polyphonic, every channel has its own random stream derived from a seed stored with the patch.
+ */
 struct NOISE : Module {
 	enum ParamId {
+		CHANNELS_PARAM,
+		VELVET_DENSITY_PARAM,
 		PARAMS_LEN
 	};
 	enum InputId {
@@ -19,45 +34,177 @@ struct NOISE : Module {
 	enum LightId {
 		LIGHTS_LEN
 	};
-    int g_x1 = 0x67452301;
-    int g_x2 = 0xefcdab89;
-    float white_buffer[128];
-    float red_buffer[128];
-    int counter = 0;
+
+    enum NoiseType {
+        PINK_NOISE,
+        RED_NOISE,
+        GAUSSIAN_NOISE,
+        VELVET_NOISE
+    };
+
+    NoiseGenerator4 generators[maxBanks];
+    uint32_t seed = 0;
+
+    // Coloured noise filters white noise. Pink noise sums three one pole lowpass filters, red (brown)
+    // noise is a leaky integrator. A single channel runs all four filters in the lanes of one vector.
+    float_4 monoFilters = float_4::zero();
+    float_4 pinkFilters[3][maxBanks] = {};
+    float_4 redFilter[maxBanks] = {};
+
+    // Gaussian noise is made in blocks of normal values, two per bank or eight for a single channel
+    float_4 gaussianBlocks[2][maxBanks] = {};
+    int gaussianIndex = 0;
+
+    // Velvet noise has one pulse of random sign at a random position in every period
+    float_4 velvetPosition[maxBanks] = {};
+    float_4 velvetSign[maxBanks] = {};
+    int velvetPeriod = 1;
+    int velvetCounter = 0;
+
+    int noiseType = RED_NOISE;
+    bool typeConnected = false;
+    int channels = 1;
+    int currentBanks = 1;
+    int loopCounter = 0;
 
 	NOISE() {
 		config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
-		configOutput(RED_OUTPUT, "");
-		configOutput(WHITE_OUTPUT, "");
+		configParam(CHANNELS_PARAM, 1.f, maxPolyphony, 1.f, "Polyphony channels")->snapEnabled = true;
+		configParam(VELVET_DENSITY_PARAM, std::log2(50.f), std::log2(5000.f), 10.f, "Velvet noise density", " pulses/s", 2.f);
+		configOutput(RED_OUTPUT, "Pink, red, Gaussian or velvet noise");
+		configOutput(WHITE_OUTPUT, "White noise");
+		seed = random::u32();
+		restart();
 	}
 
+    json_t* dataToJson() override {
+        json_t* rootJ = json_object();
+        json_object_set_new(rootJ, "seed", json_integer(seed));
+        json_object_set_new(rootJ, "noiseType", json_integer(noiseType));
+        return rootJ;
+    }
+
+    void dataFromJson(json_t* rootJ) override {
+        json_t* seedJ = json_object_get(rootJ, "seed");
+        if (seedJ)
+            seed = json_integer_value(seedJ);
+        json_t* noiseTypeJ = json_object_get(rootJ, "noiseType");
+        if (noiseTypeJ)
+            noiseType = clamp((int) json_integer_value(noiseTypeJ), (int) PINK_NOISE, (int) VELVET_NOISE);
+        restart();
+    }
+
+    void onReset(const ResetEvent& e) override {
+        Module::onReset(e);
+        restart();
+    }
+
+    /*
+     * Start every channel from the beginning of its stream, so renders of a patch are reproducible
+     */
+    void restart() {
+        for (int bank = 0; bank < maxBanks; ++bank) {
+            generators[bank].seed(seed, bank * 4);
+            pinkFilters[0][bank] = pinkFilters[1][bank] = pinkFilters[2][bank] = float_4::zero();
+            redFilter[bank] = float_4::zero();
+        }
+        monoFilters = float_4::zero();
+        gaussianIndex = 0;
+        velvetCounter = 0;
+    }
+
+    /*
+     * Process a single timestep
+     */
 	void process(const ProcessArgs& args) override {
-        counter = (counter+1) % 128;
-        if (counter == 0) {
-            fill_buffer();
+        if (loopCounter-- == 0) {
+            loopCounter = 3;
+            channels = (int) params[CHANNELS_PARAM].getValue();
+            currentBanks = (channels + 3) / 4;
+            outputs[WHITE_OUTPUT].setChannels(channels);
+            outputs[RED_OUTPUT].setChannels(channels);
+            typeConnected = outputs[RED_OUTPUT].isConnected();
+            velvetPeriod = std::max(1, (int) std::round(args.sampleRate / std::pow(2.f, params[VELVET_DENSITY_PARAM].getValue())));
         }
 
-        outputs[WHITE_OUTPUT].setVoltage(white_buffer[counter] * 10);
+        // every sample draws one value for each channel, so the load is the same on every sample
+        for (int bank = 0; bank < currentBanks; ++bank) {
+            float_4 white = generators[bank].uniform();
+            outputs[WHITE_OUTPUT].setVoltageSimd(white * 10.f, bank * 4);
+
+            if (!typeConnected)
+                continue;
+            if (noiseType == GAUSSIAN_NOISE)
+                outputs[RED_OUTPUT].setVoltageSimd(processGaussian(bank), bank * 4);
+            else if (noiseType == VELVET_NOISE)
+                outputs[RED_OUTPUT].setVoltageSimd(processVelvet(bank), bank * 4);
+            else if (channels == 1)
+                outputs[RED_OUTPUT].setVoltage(processMonoColour(white[0]));
+            else
+                outputs[RED_OUTPUT].setVoltageSimd(processColour(bank, white), bank * 4);
+        }
 
+        if (typeConnected) {
+            gaussianIndex = (gaussianIndex + 1) % ((channels == 1) ? 8 : 2);
+            velvetCounter = (velvetCounter + 1 >= velvetPeriod) ? 0 : velvetCounter + 1;
+        }
 	}
 
-    void whitenoise(
-            float* _fpDstBuffer, // Pointer to buffer
-            unsigned int _uiBufferSize = 128, // Size of buffer
-            float _fLevel = 1.f ) // Noiselevel (0.0 ... 1.0)
-    {
-        _fLevel *= g_fScale;
-
-        while( _uiBufferSize-- )
-        {
-            g_x1 ^= g_x2;
-            *_fpDstBuffer++ = g_x2 * _fLevel;
-            g_x2 += g_x1;
+    /*
+     * Filter one channel of white noise, the three pink filters and the red filter share one vector
+     */
+    float processMonoColour(float white) {
+        const float_4 poles = float_4(0.99765f, 0.96300f, 0.57000f, redPole);
+        const float_4 gains = float_4(0.0990460f, 0.2965164f, 1.0526913f, redGain);
+        monoFilters = monoFilters * poles + gains * white;
+
+        if (noiseType == PINK_NOISE)
+            return (monoFilters[0] + monoFilters[1] + monoFilters[2] + white * 0.1848f) * pinkLevel;
+        return monoFilters[3] * redLevel;
+    }
+
+    /*
+     * Filter a bank of white noise channels into the selected colour
+     */
+    float_4 processColour(int bank, float_4 white) {
+        if (noiseType == PINK_NOISE) {
+            pinkFilters[0][bank] = pinkFilters[0][bank] * 0.99765f + white * 0.0990460f;
+            pinkFilters[1][bank] = pinkFilters[1][bank] * 0.96300f + white * 0.2965164f;
+            pinkFilters[2][bank] = pinkFilters[2][bank] * 0.57000f + white * 1.0526913f;
+            return (pinkFilters[0][bank] + pinkFilters[1][bank] + pinkFilters[2][bank] + white * 0.1848f) * pinkLevel;
+        }
+        redFilter[bank] = redFilter[bank] * redPole + white * redGain;
+        return redFilter[bank] * redLevel;
+    }
+
+    /*
+     * Next Gaussian noise values of a bank. At the start of a block Box-Muller turns two extra uniform
+     * draws into two blocks of normal values, a single channel plays all lanes of both blocks in turn.
+     */
+    float_4 processGaussian(int bank) {
+        if (gaussianIndex == 0) {
+            const float twoPi = 2.f * M_PI;
+            float_4 radius = simd::sqrt(-2.f * simd::log(0.5f - 0.5f * generators[bank].uniform()));
+            float_4 angle = twoPi * (0.5f + 0.5f * generators[bank].uniform());
+            gaussianBlocks[0][bank] = radius * simd::cos(angle) * gaussianLevel;
+            gaussianBlocks[1][bank] = radius * simd::sin(angle) * gaussianLevel;
         }
+
+        if (channels == 1)
+            return gaussianBlocks[gaussianIndex / 4][0][gaussianIndex % 4];
+        return gaussianBlocks[gaussianIndex][bank];
     }
 
-    void fill_buffer() {
-        whitenoise(white_buffer);
+    /*
+     * Next velvet noise values of a bank, a new pulse position and sign is drawn at the start of every period
+     */
+    float_4 processVelvet(int bank) {
+        if (velvetCounter == 0) {
+            float_4 u = generators[bank].uniform();
+            velvetSign[bank] = simd::sgn(u) * 10.f;
+            velvetPosition[bank] = simd::floor(simd::abs(u) * float(velvetPeriod));
+        }
+        return simd::ifelse(velvetPosition[bank] == float(velvetCounter), velvetSign[bank], 0.f);
     }
 };
 
@@ -75,6 +222,27 @@ struct NOISEWidget : ModuleWidget {
 		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(12.7, 94.476)), module, NOISE::RED_OUTPUT));
 		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(12.7, 108.95)), module, NOISE::WHITE_OUTPUT));
 	}
+
+    /*
+     * Add polyphony and seed settings to module context window
+     */
+    void appendContextMenu(Menu* menu) override {
+        NOISE* module = getModule<NOISE>();
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createMenuLabel("Polyphony"));
+        menu->addChild(new GL_MenuSlider(module->paramQuantities[NOISE::CHANNELS_PARAM]));
+        menu->addChild(createIndexPtrSubmenuItem("Noise type", {"Pink", "Red (brown)", "Gaussian", "Velvet"}, &module->noiseType));
+        menu->addChild(new GL_MenuSlider(module->paramQuantities[NOISE::VELVET_DENSITY_PARAM]));
+        menu->addChild(createMenuLabel(string::f("Seed %08X", module->seed)));
+        menu->addChild(createMenuItem("Restart from seed", "", [=]() {
+            module->restart();
+        }));
+        menu->addChild(createMenuItem("New random seed", "", [=]() {
+            module->seed = random::u32();
+            module->restart();
+        }));
+    }
 };
 
 
@@ -1,6 +1,42 @@
 #include "plugin.hpp"
+#include "filters.hpp"
+#include "noise.hpp"
 
+using float_4 = simd::float_4;
+const int maxPolyphony = 16;
+const int maxBanks = maxPolyphony / 4;
 
+// The second body oscillator sits a bit below the octave, like the second mode of a drum head
+const float bodyRatio = 1.6f;
+
+/*
+ * Simd sine approximation
+ */
+inline float_4 sinTwoPi(float_4 _x) {
+    const static float twoPi = 2 * 3.141592653589793238;
+    const static float pi =  3.141592653589793238;
+    _x -= ifelse((_x > float_4(pi)), float_4(twoPi), float_4::zero());
+
+    float_4 xneg = _x < float_4::zero();
+    float_4 xOffset = ifelse(xneg, float_4(pi / 2.f), float_4(-pi  / 2.f));
+    xOffset += _x;
+    float_4 xSquared = xOffset * xOffset;
+    float_4 ret = xSquared * float_4(1.f / 24.f);
+    float_4 correction = ret * xSquared *  float_4(.02 / .254);
+    ret += float_4(-.5);
+    ret *= xSquared;
+    ret += float_4(1.f);
+
+    ret -= correction;
+    return ifelse(xneg, -ret, ret);
+}
+
+
+/*
+ * Snare drum module implementation.
+ * Two tuned sine oscillators for the body and a band pass filtered noise burst for the snares.
+ * Polyphonic, every channel of the gate or retrigger input plays its own snare.
+ */
 struct SNARES : Module {
 	enum ParamId {
 		FREQ_PARAM,
@@ -28,25 +64,155 @@ struct SNARES : Module {
 		LIGHTS_LEN
 	};
 
+    // Voice state, the envelopes are multiplied by their decay every sample
+    float_4 phase1[maxBanks] = {};
+    float_4 phase2[maxBanks] = {};
+    float_4 bodyEnvelope[maxBanks] = {};
+    float_4 noiseEnvelope[maxBanks] = {};
+    float_4 pitchEnvelope[maxBanks] = {};
+    TBiquad<float_4> bandpass[maxBanks];
+    dsp::TSchmittTrigger<float_4> gateTrigger[maxBanks];
+    dsp::TSchmittTrigger<float_4> retriggerTrigger[maxBanks];
+    NoiseGenerator4 noise[maxBanks];
+
+    // Banks without a sounding snare skip processing
+    bool idle[maxBanks] = {true, true, true, true};
+
+    // Per channel coefficients, updated every 4 samples
+    float_4 phaseAdvance[maxBanks] = {};
+    float_4 bodyDecay[maxBanks] = {};
+    float_4 noiseDecay[maxBanks] = {};
+    float pitchDecay = 0.f;
+    float lastSampleTime = 0.f;
+
+    int channels = 1;
+    int currentBanks = 1;
+    int loopCounter = 0;
+
 	SNARES() {
 		config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
-		configParam(FREQ_PARAM, 0.f, 1.f, 0.f, "");
-		configParam(NOISE_PARAM, 0.f, 1.f, 0.f, "");
-		configParam(FM_MOD_PARAM, 0.f, 1.f, 0.f, "");
-		configParam(DECAY_MOD_PARAM, 0.f, 1.f, 0.f, "");
-		configParam(CUTOFF_PARAM, 0.f, 1.f, 0.f, "");
-		configParam(DECAY_PARAM, 0.f, 1.f, 0.f, "");
-		configParam(CUTOFF_MOD_PARAM, 0.f, 1.f, 0.f, "");
-		configInput(FM_INPUT, "");
-		configInput(DECAY_INPUT, "");
-		configInput(CUTOFF_INPUT, "");
-		configInput(GATE_INPUT, "");
-		configInput(RETR_INPUT, "");
-		configOutput(OUT_OUTPUT, "");
+		configParam(FREQ_PARAM, 0.f, 1.f, 0.5f, "Frequency", " Hz", 4.f, 100.f);
+		configParam(NOISE_PARAM, 0.f, 1.f, 0.5f, "Noise", "%", 0.f, 100.f);
+		configParam(FM_MOD_PARAM, -1.f, 1.f, 0.f, "Frequency modulation", "%", 0.f, 100.f);
+		configParam(DECAY_MOD_PARAM, -1.f, 1.f, 0.f, "Decay modulation", "%", 0.f, 100.f);
+		configParam(CUTOFF_PARAM, 0.f, 1.f, 0.5f, "Cutoff", " Hz", 20.f, 500.f);
+		configParam(DECAY_PARAM, 0.f, 1.f, 0.5f, "Decay", " ms", 20.f, 50.f);
+		configParam(CUTOFF_MOD_PARAM, -1.f, 1.f, 0.f, "Cutoff modulation", "%", 0.f, 100.f);
+		configInput(FM_INPUT, "Frequency modulation (V/oct)");
+		configInput(DECAY_INPUT, "Decay modulation");
+		configInput(CUTOFF_INPUT, "Cutoff modulation");
+		configInput(GATE_INPUT, "Gate");
+		configInput(RETR_INPUT, "Retrigger");
+		configOutput(OUT_OUTPUT, "Snare");
+
+		for (int bank = 0; bank < maxBanks; ++bank) {
+		    noise[bank].seed(random::u32(), bank * 4);
+		}
 	}
 
+    /*
+     * Process a single timestep
+     */
 	void process(const ProcessArgs& args) override {
+        if (loopCounter-- == 0) {
+            loopCounter = 3;
+            processEvery4Samples(args);
+        }
+
+        const float twoPi = 2.f * M_PI;
+        float noiseLevel = params[NOISE_PARAM].getValue();
+        for (int bank = 0; bank < currentBanks; ++bank) {
+            const int currentChannel = bank * 4;
+
+            // rising edges of the gate or retrigger start a new snare
+            float_4 triggered = gateTrigger[bank].process(inputs[GATE_INPUT].getPolyVoltageSimd<float_4>(currentChannel))
+                    | retriggerTrigger[bank].process(inputs[RETR_INPUT].getPolyVoltageSimd<float_4>(currentChannel));
+            if (idle[bank]) {
+                if (simd::movemask(triggered) == 0)
+                    continue;
+                idle[bank] = false;
+                updateCoefficients(bank, args);
+            }
+            phase1[bank] = simd::ifelse(triggered, 0.f, phase1[bank]);
+            phase2[bank] = simd::ifelse(triggered, 0.f, phase2[bank]);
+            bodyEnvelope[bank] = simd::ifelse(triggered, 1.f, bodyEnvelope[bank]);
+            noiseEnvelope[bank] = simd::ifelse(triggered, 1.f, noiseEnvelope[bank]);
+            pitchEnvelope[bank] = simd::ifelse(triggered, 1.f, pitchEnvelope[bank]);
+
+            // both body oscillators start half an octave up and settle on their pitch
+            float_4 advance = phaseAdvance[bank] * (1.f + 0.5f * pitchEnvelope[bank]);
+            phase1[bank] += advance;
+            phase1[bank] -= simd::floor(phase1[bank]);
+            phase2[bank] += advance * bodyRatio;
+            phase2[bank] -= simd::floor(phase2[bank]);
+            float_4 body = (sinTwoPi(twoPi * phase1[bank]) + 0.5f * sinTwoPi(twoPi * phase2[bank])) * bodyEnvelope[bank];
+
+            // the band pass keeps roughly a third of the white noise power, make up for it
+            float_4 snares = bandpass[bank].process(noise[bank].uniform()) * noiseEnvelope[bank] * 2.f;
+
+            bodyEnvelope[bank] *= bodyDecay[bank];
+            noiseEnvelope[bank] *= noiseDecay[bank];
+            pitchEnvelope[bank] *= pitchDecay;
+
+            // snares below -80 dB are done
+            if (simd::movemask((bodyEnvelope[bank] > 1e-4f) | (noiseEnvelope[bank] > 1e-4f)) == 0) {
+                idle[bank] = true;
+                outputs[OUT_OUTPUT].setVoltageSimd(float_4::zero(), currentChannel);
+                continue;
+            }
+
+            outputs[OUT_OUTPUT].setVoltageSimd(5.f * ((1.f - noiseLevel) * body + noiseLevel * snares), currentChannel);
+        }
 	}
+
+    /*
+     * Process called only every 4 timesteps for performance optimization reasons.
+     * Updates pitch, decay and cutoff of every channel
+     */
+    void processEvery4Samples(const ProcessArgs& args) {
+        channels = std::max(std::max(inputs[GATE_INPUT].getChannels(), inputs[RETR_INPUT].getChannels()), 1);
+        currentBanks = (channels + 3) / 4;
+        outputs[OUT_OUTPUT].setChannels(channels);
+
+        // the pitch drop is fixed at 10 ms
+        if (args.sampleTime != lastSampleTime) {
+            lastSampleTime = args.sampleTime;
+            pitchDecay = std::exp(-args.sampleTime / 0.01f);
+        }
+
+        for (int bank = 0; bank < currentBanks; ++bank) {
+            if (!idle[bank])
+                updateCoefficients(bank, args);
+        }
+    }
+
+    /*
+     * Calculate pitch, decays and band pass of the channels of a bank
+     */
+    void updateCoefficients(int bank, const ProcessArgs& args) {
+        const int currentChannel = bank * 4;
+        float freqParam = params[FREQ_PARAM].getValue();
+        float decayParam = params[DECAY_PARAM].getValue();
+        float cutoffParam = params[CUTOFF_PARAM].getValue();
+        float fmMod = params[FM_MOD_PARAM].getValue();
+        float decayMod = params[DECAY_MOD_PARAM].getValue() / 10.f;
+        float cutoffMod = params[CUTOFF_MOD_PARAM].getValue() / 10.f;
+
+        // 100 Hz to 400 Hz, the frequency modulation input is in V/oct
+        float_4 pitch = freqParam * 2.f + inputs[FM_INPUT].getPolyVoltageSimd<float_4>(currentChannel) * fmMod;
+        phaseAdvance[bank] = 100.f * dsp::approxExp2_taylor5<float_4>(pitch) * args.sampleTime;
+
+        // the snares ring 50 ms to 1 s, the body dies away twice as fast
+        float_4 decay = simd::clamp(decayParam + inputs[DECAY_INPUT].getPolyVoltageSimd<float_4>(currentChannel) * decayMod, 0.f, 1.f);
+        float_4 decayTime = 0.05f * simd::pow(20.f, decay);
+        noiseDecay[bank] = simd::exp(-args.sampleTime / decayTime);
+        bodyDecay[bank] = noiseDecay[bank] * noiseDecay[bank];
+
+        // band pass centre from 500 Hz to 10 kHz
+        float_4 cutoff = simd::clamp(cutoffParam + inputs[CUTOFF_INPUT].getPolyVoltageSimd<float_4>(currentChannel) * cutoffMod, 0.f, 1.f);
+        float_4 cutoffFreq = simd::fmin(500.f * simd::pow(20.f, cutoff), 0.45f * args.sampleRate);
+        bandpass[bank].setParametersBand(cutoffFreq * args.sampleTime, 1.f);
+    }
 };
 
 
@@ -61,6 +227,7 @@ struct SNARESWidget : ModuleWidget {
         addChild(createWidget<ScrewBlack>(Vec(RACK_GRID_WIDTH - 10, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
         addChild(createWidget<ScrewBlack>(Vec(box.size.x - 2 * RACK_GRID_WIDTH + 10, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
 
+        // add parameter controls
 		addParam(createParamCentered<RoundBlackKnob>(mm2px(Vec(22.86, 18.472)), module, SNARES::FREQ_PARAM));
 		addParam(createParamCentered<RoundBlackKnob>(mm2px(Vec(22.86, 46.224)), module, SNARES::NOISE_PARAM));
 		addParam(createParamCentered<Trimpot>(mm2px(Vec(22.843, 71.511)), module, SNARES::FM_MOD_PARAM));
@@ -69,12 +236,14 @@ struct SNARESWidget : ModuleWidget {
 		addParam(createParamCentered<GL_SlidePot>(mm2px(Vec(38.852, 40.742)), module, SNARES::DECAY_PARAM));
 		addParam(createParamCentered<Trimpot>(mm2px(Vec(6.834, 71.511)), module, SNARES::CUTOFF_MOD_PARAM));
 
+        // add inputs
 		addInput(createInputCentered<PJ301MPort>(mm2px(Vec(22.86, 89.767)), module, SNARES::FM_INPUT));
 		addInput(createInputCentered<PJ301MPort>(mm2px(Vec(38.869, 89.767)), module, SNARES::DECAY_INPUT));
 		addInput(createInputCentered<PJ301MPort>(mm2px(Vec(6.851, 89.767)), module, SNARES::CUTOFF_INPUT));
 		addInput(createInputCentered<PJ301MPort>(mm2px(Vec(6.851, 108.95)), module, SNARES::GATE_INPUT));
 		addInput(createInputCentered<PJ301MPort>(mm2px(Vec(22.86, 108.95)), module, SNARES::RETR_INPUT));
 
+        // add outputs
 		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(38.869, 108.95)), module, SNARES::OUT_OUTPUT));
 	}
 };
@@ -2,8 +2,114 @@
 #include "stdio.h"
 #include "cmath"
 
+using float_4 = simd::float_4;
+const int maxPolyphony = 16;
+const int maxBanks = maxPolyphony / 4;
+const int maxModes = 64;
+const int maxModeBanks = maxModes / 4;
+
+
+/*
+ * Frequency ratios of the modes of a few vibrating objects, relative to their lowest mode
+ */
+struct ModeTables {
+    enum ModeSet {
+        HARMONIC_MODES,
+        BAR_MODES,
+        PLATE_MODES,
+        MEMBRANE_MODES,
+        NUM_MODE_SETS
+    };
+
+    float ratios[NUM_MODE_SETS][maxModes];
+
+    ModeTables() {
+        // harmonics of a string like spring
+        for (int i = 0; i < maxModes; ++i) {
+            ratios[HARMONIC_MODES][i] = i + 1;
+        }
+
+        // free bar, the roots of cos(x) cosh(x) = 1 quickly approach (n + 1/2) pi
+        const double barRoots[4] = {4.73004, 7.85320, 10.99561, 14.13717};
+        for (int i = 0; i < maxModes; ++i) {
+            double root = (i < 4) ? barRoots[i] : (i + 1.5) * M_PI;
+            ratios[BAR_MODES][i] = (root / barRoots[0]) * (root / barRoots[0]);
+        }
+
+        // simply supported rectangular plate with sides 1 and 1.5, modes at m^2 + (n / 1.5)^2
+        std::vector<double> plate;
+        for (int m = 1; m <= 16; ++m) {
+            for (int n = 1; n <= 16; ++n) {
+                plate.push_back(m * m + (n / 1.5) * (n / 1.5));
+            }
+        }
+        std::sort(plate.begin(), plate.end());
+        for (int i = 0; i < maxModes; ++i) {
+            ratios[PLATE_MODES][i] = plate[i] / plate[0];
+        }
+
+        // circular membrane, modes at the zeros of the Bessel functions
+        std::vector<double> membrane;
+        for (int order = 0; order < 32; ++order) {
+            double previous = bessel(order, 0.5);
+            for (double x = 0.55; x < 25.0; x += 0.05) {
+                double current = bessel(order, x);
+                if ((previous < 0.0) != (current < 0.0))
+                    membrane.push_back(findBesselZero(order, x - 0.05, x));
+                previous = current;
+            }
+        }
+        std::sort(membrane.begin(), membrane.end());
+        for (int i = 0; i < maxModes; ++i) {
+            ratios[MEMBRANE_MODES][i] = membrane[i] / membrane[0];
+        }
+    }
+
+    /*
+     * Bessel function of the first kind from its power series, accurate enough for x below 25
+     */
+    static double bessel(int order, double x) {
+        double term = 1.0;
+        for (int k = 1; k <= order; ++k) {
+            term *= x / 2.0 / k;
+        }
+        double sum = term;
+        for (int k = 1; k < 100; ++k) {
+            term *= -(x / 2.0) * (x / 2.0) / (k * (double) (k + order));
+            sum += term;
+        }
+        return sum;
+    }
+
+    static double findBesselZero(int order, double low, double high) {
+        double lowValue = bessel(order, low);
+        for (int i = 0; i < 40; ++i) {
+            double middle = (low + high) / 2.0;
+            double middleValue = bessel(order, middle);
+            if ((middleValue < 0.0) == (lowValue < 0.0)) {
+                low = middle;
+                lowValue = middleValue;
+            }
+            else {
+                high = middle;
+            }
+        }
+        return (low + high) / 2.0;
+    }
+};
+
+static const ModeTables& getModeTables() {
+    static const ModeTables tables;
+    return tables;
+}
+
+
+/*
+ * Damped spring modulation source.
+ * Every channel is a recursive resonator: a complex value that is rotated and shrunk every sample,
+ * its real part follows the damped oscillation of the spring.
+ */
 struct SpringMod : Module {
-    float t = 0.f;
     float A0 = 10.f;
 	enum ParamId {
 		MASS_PARAM,
@@ -12,6 +118,7 @@ struct SpringMod : Module {
 		MASSMOD_PARAM,
 		SPRINGMOD_PARAM,
 		VISCMOD_PARAM,
+		MODES_PARAM,
 		PARAMS_LEN
 	};
 	enum InputId {
@@ -29,6 +136,45 @@ struct SpringMod : Module {
 		LIGHTS_LEN
 	};
 
+    // Resonator state, released at 1 + 0i which is the spring stretched to A0
+    float_4 real[maxBanks];
+    float_4 imaginary[maxBanks] = {};
+    dsp::TSchmittTrigger<float_4> trigger[maxBanks];
+
+    // Rotation of every sample, only recalculated when the spring changes
+    float_4 rotationReal[maxBanks] = {};
+    float_4 rotationImaginary[maxBanks] = {};
+    float_4 lastMass[maxBanks] = {};
+    float_4 lastViscosity[maxBanks] = {};
+    float_4 lastSpringConstant[maxBanks] = {};
+    float lastSampleTime = 0.f;
+
+    int channels = 1;
+    int currentBanks = 1;
+    int loopCounter = 0;
+
+    // Modal synthesis rings a bank of damped modes on the first channel, the spring sets the lowest
+    // mode and its damping, higher modes decay faster
+    enum Resonator {
+        SPRING_RESONATOR,
+        HARMONIC_RESONATOR,
+        BAR_RESONATOR,
+        PLATE_RESONATOR,
+        MEMBRANE_RESONATOR
+    };
+    int resonator = SPRING_RESONATOR;
+    bool audioExcitation = false;
+    float_4 modalReal[maxModeBanks] = {};
+    float_4 modalImaginary[maxModeBanks] = {};
+    float_4 modalRotationReal[maxModeBanks] = {};
+    float_4 modalRotationImaginary[maxModeBanks] = {};
+    float_4 modalAmplitude[maxModeBanks] = {};
+    float_4 modalInputGain[maxModeBanks] = {};
+    dsp::SchmittTrigger modalTrigger;
+    int activeResonator = -1;
+    int modeCount = 0;
+    int modeBanks = 0;
+
 	SpringMod() {
 		config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
 		configParam(MASS_PARAM, 0.1f, 100.f, 0.f, "Mass", " kg");
@@ -37,30 +183,209 @@ struct SpringMod : Module {
 		configParam(MASSMOD_PARAM, -1.f, 1.f, 0.f, "Mass modulation", "%", 0.f, 100.f);
 		configParam(SPRINGMOD_PARAM, -1.f, 1.f, 0.f, "Spring constant modulation", "%", 0.f, 100.f);
 		configParam(VISCMOD_PARAM, -1.f, 1.f, 0.f, "Viscosity modulation" ,"%", 0.f, 100.f);
+		configParam(MODES_PARAM, 16.f, maxModes, 32.f, "Modes")->snapEnabled = true;
 		configInput(MASSMOD_INPUT, "Mass modulation");
 		configInput(SPRINGMOD_INPUT, "Spring constant modulation");
 		configInput(VISCMOD_INPUT, "Viscosity modulation");
 		configInput(TRIG_INPUT, "Trigger");
 		configOutput(OUT_OUTPUT, "Output");
+
+		for (int bank = 0; bank < maxBanks; ++bank) {
+		    real[bank] = 1.f;
+		}
+		getModeTables();
 	}
 
+    json_t* dataToJson() override {
+        json_t* rootJ = json_object();
+        json_object_set_new(rootJ, "resonator", json_integer(resonator));
+        json_object_set_new(rootJ, "audioExcitation", json_boolean(audioExcitation));
+        return rootJ;
+    }
+
+    void dataFromJson(json_t* rootJ) override {
+        json_t* resonatorJ = json_object_get(rootJ, "resonator");
+        if (resonatorJ)
+            resonator = clamp((int) json_integer_value(resonatorJ), (int) SPRING_RESONATOR, (int) MEMBRANE_RESONATOR);
+        json_t* audioExcitationJ = json_object_get(rootJ, "audioExcitation");
+        if (audioExcitationJ)
+            audioExcitation = json_boolean_value(audioExcitationJ);
+    }
+
+    /*
+     * Process a single timestep
+     */
 	void process(const ProcessArgs& args) override {
-        // get inputs
+        if (loopCounter-- == 0) {
+            loopCounter = 3;
+            processEvery4Samples(args);
+        }
+
+        if (activeResonator != SPRING_RESONATOR) {
+            processModes();
+            return;
+        }
+
+        for (int bank = 0; bank < currentBanks; ++bank) {
+            // a rising edge releases the spring from its starting position again
+            float_4 triggered = trigger[bank].process(inputs[TRIG_INPUT].getPolyVoltageSimd<float_4>(bank * 4));
+            real[bank] = simd::ifelse(triggered, 1.f, real[bank]);
+            imaginary[bank] = simd::ifelse(triggered, 0.f, imaginary[bank]);
+
+            float_4 newReal = real[bank] * rotationReal[bank] - imaginary[bank] * rotationImaginary[bank];
+            imaginary[bank] = real[bank] * rotationImaginary[bank] + imaginary[bank] * rotationReal[bank];
+            real[bank] = newReal;
+
+            // send to output
+            outputs[OUT_OUTPUT].setVoltageSimd(A0 * real[bank], bank * 4);
+        }
+    }
+
+    /*
+     * Process called only every 4 timesteps for performance optimization reasons.
+     * Reads the spring parameters of every channel and updates the rotations of those that changed
+     */
+    void processEvery4Samples(const ProcessArgs& args) {
+        if (resonator != SPRING_RESONATOR) {
+            processModesEvery4Samples(args);
+            return;
+        }
+        bool recalculate = args.sampleTime != lastSampleTime || activeResonator != SPRING_RESONATOR;
+        activeResonator = resonator;
+
+        channels = std::max(inputs[TRIG_INPUT].getChannels(), 1);
+        currentBanks = (channels + 3) / 4;
+        outputs[OUT_OUTPUT].setChannels(channels);
+
+        lastSampleTime = args.sampleTime;
+
+        for (int bank = 0; bank < currentBanks; ++bank) {
+            const int currentChannel = bank * 4;
+
+            // get inputs
+            float_4 mass = params[MASS_PARAM].getValue() + inputs[MASSMOD_INPUT].getPolyVoltageSimd<float_4>(currentChannel) * params[MASSMOD_PARAM].getValue();
+            float_4 viscosity = params[VISC_PARAM].getValue() + inputs[VISCMOD_INPUT].getPolyVoltageSimd<float_4>(currentChannel) * params[VISCMOD_PARAM].getValue();
+            float_4 springConstant = (params[SPRING_PARAM].getValue() + inputs[SPRINGMOD_INPUT].getPolyVoltageSimd<float_4>(currentChannel) * params[SPRINGMOD_PARAM].getValue()) * 1000;
+
+            float_4 changed = (mass != lastMass[bank]) | (viscosity != lastViscosity[bank]) | (springConstant != lastSpringConstant[bank]);
+            if (!recalculate && simd::movemask(changed) == 0)
+                continue;
+            lastMass[bank] = mass;
+            lastViscosity[bank] = viscosity;
+            lastSpringConstant[bank] = springConstant;
+            setRotation(bank, mass, viscosity, springConstant, args.sampleTime);
+        }
+    }
+
+    /*
+     * Rotation of one sample: the damping shrinks the resonator by exp(-c / 2m) per second and it turns
+     * at the damped angular frequency sqrt(k / m - (c / 2m)^2), an overdamped spring does not turn
+     */
+    void setRotation(int bank, float_4 mass, float_4 viscosity, float_4 springConstant, float sampleTime) {
+        mass = simd::fmax(mass, 0.01f);
+        // modulation can push the viscosity below 0, a negative damping would make the spring grow without end
+        float_4 damping = simd::fmax(viscosity / (2.f * mass), 0.f);
+        float_4 angularFrequency = simd::sqrt(simd::fmax(springConstant / mass - damping * damping, 0.f));
+
+        float_4 decay = simd::exp(-damping * sampleTime);
+        float_4 angle = angularFrequency * sampleTime;
+        rotationReal[bank] = decay * simd::cos(angle);
+        rotationImaginary[bank] = decay * simd::sin(angle);
+    }
+
+    /*
+     * Ring the mode bank of the first channel, excited by a trigger or by the trigger input as audio
+     */
+    void processModes() {
+        float in = inputs[TRIG_INPUT].getVoltage();
+        float_4 excitation = 0.f;
+        if (audioExcitation) {
+            excitation = in / A0;
+        }
+        else if (modalTrigger.process(in)) {
+            for (int bank = 0; bank < modeBanks; ++bank) {
+                modalReal[bank] = modalAmplitude[bank];
+                modalImaginary[bank] = 0.f;
+            }
+        }
+
+        float_4 sum = 0.f;
+        for (int bank = 0; bank < modeBanks; ++bank) {
+            float_4 newReal = modalReal[bank] * modalRotationReal[bank] - modalImaginary[bank] * modalRotationImaginary[bank]
+                    + modalInputGain[bank] * excitation;
+            modalImaginary[bank] = modalReal[bank] * modalRotationImaginary[bank] + modalImaginary[bank] * modalRotationReal[bank];
+            modalReal[bank] = newReal;
+            sum += newReal;
+        }
+
+        outputs[OUT_OUTPUT].setVoltage(A0 * (sum[0] + sum[1] + sum[2] + sum[3]));
+    }
+
+    /*
+     * Read the spring parameters of the first channel and recalculate the modes when anything changed
+     */
+    void processModesEvery4Samples(const ProcessArgs& args) {
+        outputs[OUT_OUTPUT].setChannels(1);
+
         float mass = params[MASS_PARAM].getValue() + inputs[MASSMOD_INPUT].getVoltage() * params[MASSMOD_PARAM].getValue();
         float viscosity = params[VISC_PARAM].getValue() + inputs[VISCMOD_INPUT].getVoltage() * params[VISCMOD_PARAM].getValue();
-        float spring_constant = (params[SPRING_PARAM].getValue() + inputs[SPRINGMOD_INPUT].getVoltage() * params[SPRINGMOD_PARAM].getValue()) * 1000;
-        t += args.sampleTime;
+        float springConstant = (params[SPRING_PARAM].getValue() + inputs[SPRINGMOD_INPUT].getVoltage() * params[SPRINGMOD_PARAM].getValue()) * 1000;
+        int count = (int) params[MODES_PARAM].getValue();
+
+        bool changed = resonator != activeResonator || count != modeCount || args.sampleTime != lastSampleTime
+                || mass != lastMass[0][0] || viscosity != lastViscosity[0][0] || springConstant != lastSpringConstant[0][0];
+        if (!changed)
+            return;
 
-        // reset phase if trigger is on
-        if (inputs[TRIG_INPUT].getVoltage() > 0.f) {
-            t = 0;
+        if (resonator != activeResonator) {
+            for (int bank = 0; bank < maxModeBanks; ++bank) {
+                modalReal[bank] = modalImaginary[bank] = 0.f;
+            }
         }
+        activeResonator = resonator;
+        modeCount = count;
+        modeBanks = (count + 3) / 4;
+        lastSampleTime = args.sampleTime;
+        lastMass[0] = mass;
+        lastViscosity[0] = viscosity;
+        lastSpringConstant[0] = springConstant;
+        setModes(mass, viscosity, springConstant, args.sampleTime);
+    }
+
+    /*
+     * Rotation, level and input gain of every mode. Mode n turns ratio(n) times faster than the spring and
+     * is damped sqrt(ratio(n)) times harder, levels fall with 1 / sqrt(n) and modes above Nyquist are silent.
+     */
+    void setModes(float mass, float viscosity, float springConstant, float sampleTime) {
+        const float* ratios = getModeTables().ratios[activeResonator - HARMONIC_RESONATOR];
+        mass = std::max(mass, 0.01f);
+        // modulation can push the viscosity below 0, a negative damping would make the modes grow without end
+        float damping = std::max(viscosity / (2.f * mass), 0.f);
+        float angularFrequency = std::sqrt(std::max(springConstant / mass - damping * damping, 0.f));
+
+        // levels of the audible modes add up to 1, so a struck bank starts at A0 like the spring
+        float totalLevel = 0.f;
+        for (int mode = 0; mode < modeCount; ++mode) {
+            if (angularFrequency * ratios[mode] * sampleTime < 0.9f * M_PI)
+                totalLevel += 1.f / std::sqrt(mode + 1.f);
+        }
+        totalLevel = std::max(totalLevel, 1.f);
+
+        for (int bank = 0; bank < modeBanks; ++bank) {
+            float_4 ratio = float_4::load(&ratios[bank * 4]);
+            float_4 mode = float_4(1.f, 2.f, 3.f, 4.f) + float(bank * 4);
+            float_4 angle = angularFrequency * ratio * sampleTime;
+            float_4 decay = simd::exp(-damping * simd::sqrt(ratio) * sampleTime);
+            float_4 audible = (angle < float(0.9f * M_PI)) & (mode <= float(modeCount));
 
-        // calculate output
-        float output = A0 * exp((-viscosity * t)/(2 * mass)) * cos(sqrt((spring_constant / mass) - pow((viscosity/2 * mass), 2)) * t);
+            modalRotationReal[bank] = decay * simd::cos(angle);
+            modalRotationImaginary[bank] = decay * simd::sin(angle);
+            modalAmplitude[bank] = simd::ifelse(audible, 1.f / (simd::sqrt(mode) * totalLevel), 0.f);
 
-        // send to output
-        outputs[OUT_OUTPUT].setVoltage(output);
+            // driven by audio the lowest mode has unity gain at its resonance, only the positive
+            // frequency half of a real input drives a complex resonator
+            modalInputGain[bank] = simd::ifelse(audible, 2.f / simd::sqrt(mode), 0.f) * (1.f - decay);
+        }
     }
 };
 
@@ -89,6 +414,18 @@ struct SpringModWidget : ModuleWidget {
 
 		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(37.732, 108.95)), module, SpringMod::OUT_OUTPUT));
 	}
+
+    /*
+     * Add modal synthesis settings to module context window
+     */
+    void appendContextMenu(Menu* menu) override {
+        SpringMod* module = getModule<SpringMod>();
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createIndexPtrSubmenuItem("Resonator", {"Spring", "Harmonic modes", "Bar", "Plate", "Membrane"}, &module->resonator));
+        menu->addChild(new GL_MenuSlider(module->paramQuantities[SpringMod::MODES_PARAM]));
+        menu->addChild(createBoolPtrMenuItem("Trigger input is audio", "", &module->audioExcitation));
+    }
 };
 
 
@@ -1,5 +1,41 @@
 #include "plugin.hpp"
 
+using float_4 = simd::float_4;
+const int maxPolyphony = 16;
+const int maxBanks = maxPolyphony / 4;
+
+
+/*
+ * Lookup table of the exponential response, 60 dB of range with the lowest step faded to silence
+ */
+struct ExponentialResponse {
+    static const int size = 32;
+    float table[size + 1];
+
+    ExponentialResponse() {
+        for (int i = 0; i <= size; ++i) {
+            float x = (float) i / size;
+            table[i] = std::pow(10.f, 3.f * (x - 1.f)) * std::min(x * size, 1.f);
+        }
+    }
+
+    float_4 lookup(float_4 x) const {
+        x = simd::clamp(x, 0.f, 1.f) * float(size);
+        float_4 index = simd::fmin(simd::floor(x), float(size - 1));
+        float_4 fraction = x - index;
+        float_4 low;
+        float_4 high;
+        for (int lane = 0; lane < 4; ++lane) {
+            int i = (int) index[lane];
+            low[lane] = table[i];
+            high[lane] = table[i + 1];
+        }
+        return low + (high - low) * fraction;
+    }
+};
+
+static const ExponentialResponse exponentialResponse;
+
 
 struct VCA : Module {
 
@@ -44,14 +80,24 @@ struct VCA : Module {
 		LIGHTS_LEN
 	};
 
-    int polyphony1 = 1;
-    int polyphony2 = 1;
-    float amp1 = 0.f;
-    float amp2 = 0.f;
-    bool mod1Connected = false;
-    bool mod2Connected = false;
+    enum Response {
+        LINEAR_RESPONSE,
+        EXPONENTIAL_RESPONSE
+    };
+
+    // Both amplifiers are handled by the same code, indexed by amplifier
+    int polyphony[2] = {};
+    bool modConnected[2] = {};
+    float slider[2] = {1.f, 1.f};
+    float targetSlider[2] = {1.f, 1.f};
+    float smoothing = 1.f;
     int steps = 0;
 
+    const float_4 laneIndex = float_4(0.f, 1.f, 2.f, 3.f);
+
+    int response = LINEAR_RESPONSE;
+    bool sumVoices = false;
+
 	VCA() {
 		config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
 		configParam(AMP1_PARAM, 0.f, 1.f, 1.f, "Amplitude", "%", 0.f, 100.f);
@@ -71,52 +117,33 @@ struct VCA : Module {
             process4steps(args);
         }
 
-        // if mod1 is not connected use slider to control amplitude
-        if (!mod1Connected){
-            for (int i = 0; i < polyphony1; i++){
-                float out = inputs[IN1_INPUT].getVoltage(i) * amp1;
-                outputs[OUT1_OUTPUT].setVoltage(out, i);
-            }
-            if (steps == 0) {
-                setLights(amp1*10, 1);
-            }
-        }
+        processAmplifier(0);
+        processAmplifier(1);
+	}
 
-        // if connected use cv to control amplitude
-        else{
-            float mod = 0.f;
-            for (int i = 0; i < polyphony1; i++){
-                mod = (inputs[MOD1_INPUT].getVoltage(i)/10.f);
-                float out = inputs[IN1_INPUT].getVoltage(i) * mod;
-                outputs[OUT1_OUTPUT].setVoltage(out, i);
-            }
-            if (steps == 0) {
-                setLights(mod*10, 1);
-            }
-        }
+    /*
+     * Amplify every voice of one amplifier. The cv is applied every sample, the slider glides towards its
+     * position to avoid clicks. When summing, the voices are mixed into a single output channel in the same pass.
+     */
+    void processAmplifier(int amp) {
+        const int banks = (polyphony[amp] + 3) / 4;
+        float_4 sum = float_4::zero();
+        slider[amp] += (targetSlider[amp] - slider[amp]) * smoothing;
 
-        // same for second channel
-        if (!mod2Connected){
-            for (int i = 0; i < polyphony2; i++){
-                float out = inputs[IN2_INPUT].getVoltage(i) * amp2;
-                outputs[OUT2_OUTPUT].setVoltage(out, i);
-            }
-            if (steps == 0) {
-                setLights(amp2*10, 2);
-            }
-        }
-        else{
-            float mod = 0.f;
-            for (int i = 0; i < polyphony2; i++){
-                mod = (inputs[MOD2_INPUT].getVoltage(i)/10.f);
-                float out = inputs[IN2_INPUT].getVoltage(i)*mod;
-                outputs[OUT2_OUTPUT].setVoltage(out, i);
-            }
-            if (steps == 0) {
-                setLights(mod*10, 2);
-            }
+        for (int bank = 0; bank < banks; ++bank) {
+            float_4 control = modConnected[amp] ? inputs[MOD1_INPUT + amp].getPolyVoltageSimd<float_4>(bank * 4) / 10.f : float_4(slider[amp]);
+            float_4 gain = (response == EXPONENTIAL_RESPONSE) ? exponentialResponse.lookup(control) : control;
+            float_4 out = inputs[IN1_INPUT + amp].getPolyVoltageSimd<float_4>(bank * 4) * gain;
+            // a mono input is copied to every lane, only the lanes of actual voices are summed
+            if (sumVoices)
+                sum += simd::ifelse(laneIndex < float(polyphony[amp] - bank * 4), out, 0.f);
+            else
+                outputs[OUT1_OUTPUT + amp].setVoltageSimd(out, bank * 4);
         }
-	}
+
+        if (sumVoices)
+            outputs[OUT1_OUTPUT + amp].setVoltage(sum[0] + sum[1] + sum[2] + sum[3]);
+    }
 
     void setLights(float amplitude, int channel) {
         if (channel == 1) {
@@ -142,19 +169,44 @@ struct VCA : Module {
     }
 
     void process4steps(const ProcessArgs& args) {
-        // get and set polyphony channels
-        polyphony1 = inputs[IN1_INPUT].getChannels();
-        polyphony2 = inputs[IN2_INPUT].getChannels();
-        outputs[OUT1_OUTPUT].setChannels(polyphony1);
-        outputs[OUT2_OUTPUT].setChannels(polyphony2);
-
-        // read amplitude param
-        amp1 = params[AMP1_PARAM].getValue();
-        amp2 = params[AMP2_PARAM].getValue();
-
-        // read if modulation inputs are connected to overwrite the sliders
-        mod1Connected = inputs[MOD1_INPUT].isConnected();
-        mod2Connected = inputs[MOD2_INPUT].isConnected();
+        // slider glides with a 1 ms time constant
+        smoothing = 1.f - std::exp(-args.sampleTime / 0.001f);
+
+        for (int amp = 0; amp < 2; ++amp) {
+            // get and set polyphony channels
+            polyphony[amp] = inputs[IN1_INPUT + amp].getChannels();
+            outputs[OUT1_OUTPUT + amp].setChannels(sumVoices ? std::min(polyphony[amp], 1) : polyphony[amp]);
+
+            // modulation inputs overwrite the sliders, every voice gets its own cv
+            modConnected[amp] = inputs[MOD1_INPUT + amp].isConnected();
+            targetSlider[amp] = params[AMP1_PARAM + amp].getValue();
+
+            // lights show the loudest voice
+            float level = targetSlider[amp];
+            if (modConnected[amp]) {
+                level = 0.f;
+                for (int channel = 0; channel < std::max(polyphony[amp], 1); ++channel) {
+                    level = std::max(level, inputs[MOD1_INPUT + amp].getPolyVoltage(channel) / 10.f);
+                }
+            }
+            setLights(level * 10, amp + 1);
+        }
+    }
+
+    json_t* dataToJson() override {
+        json_t* rootJ = json_object();
+        json_object_set_new(rootJ, "response", json_integer(response));
+        json_object_set_new(rootJ, "sumVoices", json_boolean(sumVoices));
+        return rootJ;
+    }
+
+    void dataFromJson(json_t* rootJ) override {
+        json_t* responseJ = json_object_get(rootJ, "response");
+        if (responseJ)
+            response = clamp((int) json_integer_value(responseJ), (int) LINEAR_RESPONSE, (int) EXPONENTIAL_RESPONSE);
+        json_t* sumVoicesJ = json_object_get(rootJ, "sumVoices");
+        if (sumVoicesJ)
+            sumVoices = json_boolean_value(sumVoicesJ);
     }
 };
 
@@ -208,6 +260,17 @@ struct VCAWidget : ModuleWidget {
         addChild(createLightCentered<MediumLight<RedLight>>(mm2px(Vec(17.347, 24.209)), module, VCA::L2_9_LIGHT));
 		addChild(createLightCentered<MediumLight<RedLight>>(mm2px(Vec(17.347, 19.397)), module, VCA::L2_10_LIGHT));
 	}
+
+    /*
+     * Add response and voice summing settings to module context window
+     */
+    void appendContextMenu(Menu* menu) override {
+        VCA* module = getModule<VCA>();
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createIndexPtrSubmenuItem("Response", {"Linear", "Exponential"}, &module->response));
+        menu->addChild(createBoolPtrMenuItem("Sum voices to mono", "", &module->sumVoices));
+    }
 };
 
 
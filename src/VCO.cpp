@@ -5,6 +5,11 @@
 using float_4 = simd::float_4;
 const int maxPolyphony = 16;
 static const int maxBanks = maxPolyphony / 4;
+static const int maxUnison = 16;
+static const int maxUnisonBanks = maxUnison / 4;
+static const int maxOscillatorBanks = maxPolyphony * maxUnisonBanks;
+static const int maxPartials = 64;
+static const int maxPartialBanks = maxPartials / 4;
 
 inline float_4 sinTwoPi(float_4 _x) {
     const static float twoPi = 2 * 3.141592653589793238;
@@ -31,6 +36,22 @@ struct VCO : Module {
 		PULSE_PARAM,
 		FMPARAM_PARAM,
 		PULSEMODPARAM_PARAM,
+		UNISON_PARAM,
+		DETUNE_PARAM,
+		SPREAD_PARAM,
+		ALGORITHM_PARAM,
+		FEEDBACK_PARAM,
+		RATIO1_PARAM,
+		RATIO2_PARAM,
+		RATIO3_PARAM,
+		RATIO4_PARAM,
+		LEVEL1_PARAM,
+		LEVEL2_PARAM,
+		LEVEL3_PARAM,
+		LEVEL4_PARAM,
+		PARTIALS_PARAM,
+		TILT_PARAM,
+		EVEN_PARAM,
 		PARAMS_LEN
 	};
 	enum InputId {
@@ -51,22 +72,94 @@ struct VCO : Module {
 		LIGHTS_LEN
 	};
 
-    float_4 phaseAccumulators[maxBanks] = {};
-    float_4 phaseAdvance[maxBanks] = {};
-    dsp::MinBlepGenerator<16, 16, float_4> sawMinBlep[maxBanks];
-    dsp::MinBlepGenerator<16, 16, float_4> sqrMinBlep[maxBanks];
-    float_4 dcOffsetCompensation[maxBanks] = {};
+    // Oscillator state, one lane per (sub-)oscillator.
+    // Without unison, bank b holds voices 4b..4b+3.
+    // With unison, voice v owns banks v * unisonBanks .. (v + 1) * unisonBanks - 1, one sub-oscillator per lane.
+    float_4 phaseAccumulators[maxOscillatorBanks] = {};
+    float_4 phaseAdvance[maxOscillatorBanks] = {};
+    dsp::MinBlepGenerator<16, 16, float_4> sawMinBlep[maxOscillatorBanks];
+    dsp::MinBlepGenerator<16, 16, float_4> sqrMinBlep[maxOscillatorBanks];
+    float_4 dcOffsetCompensation[maxOscillatorBanks] = {};
     bool sync_connected = false;
     float sync_prev = 0;
 
-    float pulsewidth = 1.f;
+    // Per lane pitch offset (V) and output gains of the unison sub-oscillators
+    float_4 unisonDetune[maxUnisonBanks] = {};
+    float_4 unisonGainLeft[maxUnisonBanks] = {};
+    float_4 unisonGainRight[maxUnisonBanks] = {};
+    int unison = 1;
+    int unisonBanks = 1;
+    float unisonDetuneParam = -1.f;
+    float unisonSpreadParam = -1.f;
+    bool unisonStereo = false;
+    bool unisonStereoApplied = false;
+
+    // Pulse width per voice, and the pulse width and raw square each oscillator lane used last sample
+    float_4 pulsewidth[maxBanks] = {};
+    float_4 lastPulsewidth[maxOscillatorBanks] = {};
+    float_4 lastSqr[maxOscillatorBanks] = {};
+    float pulseWidthParam = 0.5f;
+    float pulseModParam = 0.f;
+    bool audioRatePwm = false;
+
     int currentPolyphony = 1;
     int currentBanks = 1;
+    int voiceBanks = 1;
     int loopCounter = 0;
-    bool outputSaw = false;
-    bool outputSin = false;
-    bool outputSqr = false;
-    bool outputTri = false;
+
+    // Connected outputs, the output kernel is specialized for every combination of them
+    enum OutputMask {
+        SAW_MASK = 1 << 0,
+        SQR_MASK = 1 << 1,
+        SIN_MASK = 1 << 2,
+        TRI_MASK = 1 << 3
+    };
+    typedef void (VCO::*OutputKernel)();
+    int outputMask = 0;
+    OutputKernel outputKernel = &VCO::generateOutputKernel<0>;
+
+    // Mono path: a single voice computes 4 consecutive samples at once, one per lane.
+    // Pitch is only read every 4 samples, so a whole block is known when it starts and there is no added latency.
+    bool monoBlock = false;
+    OutputKernel monoKernel = &VCO::generateMonoBlock<0>;
+    dsp::MinBlepGenerator<16, 16, float> monoSawMinBlep;
+    dsp::MinBlepGenerator<16, 16, float> monoSqrMinBlep;
+    float_4 monoSaw = 0.f;
+    float_4 monoSqr = 0.f;
+    float_4 monoSin = 0.f;
+    float_4 monoTri = 0.f;
+
+    // FM mode: every voice is a 4 operator phase modulation voice, operator i in lane i.
+    // fmRouting[j] holds how much operator j modulates each operator, the carriers are mixed to the sine output.
+    enum Mode {
+        SUBTRACTIVE_MODE,
+        FM_MODE,
+        ADDITIVE_MODE
+    };
+    int mode = SUBTRACTIVE_MODE;
+    int activeMode = SUBTRACTIVE_MODE;
+    float_4 fmPhases[maxPolyphony] = {};
+    float_4 fmAdvance[maxPolyphony] = {};
+    float_4 fmOutputs[maxPolyphony] = {};
+    float_4 fmRouting[4] = {};
+    float_4 fmLevels = 0.f;
+    float_4 fmCarriers = 0.f;
+
+    // Additive mode: partial k of a voice is a phasor (cos, sin) rotated by k times the fundamental every sample,
+    // 4 partials per bank. Partials above nyquist are left out per block.
+    float_4 partialCos[maxPolyphony][maxPartialBanks];
+    float_4 partialSin[maxPolyphony][maxPartialBanks];
+    float_4 rotationCos[maxPolyphony][maxPartialBanks];
+    float_4 rotationSin[maxPolyphony][maxPartialBanks];
+    int audibleBanks[maxPolyphony] = {};
+    float_4 lastBankAmplitudes[maxPolyphony] = {};
+    float_4 partialAmplitudes[maxPartialBanks] = {};
+    float partialTable[maxPartials];
+    bool usePartialTable = false;
+    bool partialsChanged = true;
+    int partialCount = 0;
+    float partialTilt = -1.f;
+    float partialEven = -1.f;
 
     VCO() {
         config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
@@ -74,6 +167,27 @@ struct VCO : Module {
         configParam(PULSE_PARAM, 0.01f, 0.99f, 0.5f, "Pulse width", "%", 0.f, 100.f);
         configParam(FMPARAM_PARAM, -1.f, 1.f, 0.f, "Frequency modulation", "%", 0.f, 100.f);
         configParam(PULSEMODPARAM_PARAM, -1.f, 1.f, 0.f, "Pulse Width modulation", "%", 0.f, 100.f);
+        configParam(UNISON_PARAM, 1.f, maxUnison, 1.f, "Unison voices")->snapEnabled = true;
+        configParam(DETUNE_PARAM, 0.f, 1.f, 0.2f, "Unison detune", " cents", 0.f, 100.f);
+        configParam(SPREAD_PARAM, 0.f, 1.f, 0.5f, "Unison stereo spread", "%", 0.f, 100.f);
+        configSwitch(ALGORITHM_PARAM, 0.f, 7.f, 0.f, "FM algorithm", {
+            "4 > 3 > 2 > 1",
+            "(3 + 4) > 2 > 1",
+            "(4 + (3 > 2)) > 1",
+            "4 > (2 + 3) > 1",
+            "(2 > 1) + (4 > 3)",
+            "4 > (1 + 2 + 3)",
+            "1 + 2 + (4 > 3)",
+            "1 + 2 + 3 + 4"
+        });
+        configParam(FEEDBACK_PARAM, 0.f, 1.f, 0.f, "FM operator 4 feedback", "%", 0.f, 100.f);
+        for (int i = 0; i < 4; ++i) {
+            configParam(RATIO1_PARAM + i, 0.25f, 16.f, i == 0 ? 1.f : i, string::f("FM operator %d ratio", i + 1), "x");
+            configParam(LEVEL1_PARAM + i, 0.f, 1.f, i == 0 ? 1.f : 0.5f, string::f("FM operator %d level", i + 1), "%", 0.f, 100.f);
+        }
+        configParam(PARTIALS_PARAM, 1.f, maxPartials, 32.f, "Additive partials")->snapEnabled = true;
+        configParam(TILT_PARAM, 0.f, 2.f, 1.f, "Additive spectral tilt");
+        configParam(EVEN_PARAM, 0.f, 1.f, 1.f, "Additive even partials", "%", 0.f, 100.f);
         configInput(VOCT_INPUT, "1V/octave pitch");
         configInput(FM_INPUT, "Frequency modulation");
         configInput(SYNC_INPUT, "Sync");
@@ -82,6 +196,50 @@ struct VCO : Module {
         configOutput(TRIANGLE_OUTPUT, "Triangle");
         configOutput(SAW_OUTPUT, "Saw");
         configOutput(SQUARE_OUTPUT, "Square");
+
+        for (int bank = 0; bank < maxOscillatorBanks; ++bank) {
+            lastSqr[bank] = 1.f;
+        }
+        resetPartials();
+        for (int i = 0; i < maxPartials; ++i) {
+            partialTable[i] = 1.f / (i + 1);
+        }
+    }
+
+    json_t* dataToJson() override {
+        json_t* rootJ = json_object();
+        json_object_set_new(rootJ, "unisonStereo", json_boolean(unisonStereo));
+        json_object_set_new(rootJ, "audioRatePwm", json_boolean(audioRatePwm));
+        json_object_set_new(rootJ, "mode", json_integer(mode));
+        json_object_set_new(rootJ, "usePartialTable", json_boolean(usePartialTable));
+        json_t* partialTableJ = json_array();
+        for (int i = 0; i < maxPartials; ++i) {
+            json_array_append_new(partialTableJ, json_real(partialTable[i]));
+        }
+        json_object_set_new(rootJ, "partialTable", partialTableJ);
+        return rootJ;
+    }
+
+    void dataFromJson(json_t* rootJ) override {
+        json_t* unisonStereoJ = json_object_get(rootJ, "unisonStereo");
+        if (unisonStereoJ)
+            unisonStereo = json_boolean_value(unisonStereoJ);
+        json_t* audioRatePwmJ = json_object_get(rootJ, "audioRatePwm");
+        if (audioRatePwmJ)
+            audioRatePwm = json_boolean_value(audioRatePwmJ);
+        json_t* modeJ = json_object_get(rootJ, "mode");
+        if (modeJ)
+            mode = clamp((int) json_integer_value(modeJ), (int) SUBTRACTIVE_MODE, (int) ADDITIVE_MODE);
+        json_t* usePartialTableJ = json_object_get(rootJ, "usePartialTable");
+        if (usePartialTableJ)
+            usePartialTable = json_boolean_value(usePartialTableJ);
+        json_t* partialTableJ = json_object_get(rootJ, "partialTable");
+        if (partialTableJ) {
+            for (int i = 0; i < maxPartials && i < (int) json_array_size(partialTableJ); ++i) {
+                partialTable[i] = json_number_value(json_array_get(partialTableJ, i));
+            }
+        }
+        partialsChanged = true;
     }
 
     /*
@@ -92,9 +250,71 @@ struct VCO : Module {
         if (loopCounter-- == 0) {
             loopCounter = 3;
             processEvery4Samples(args);
+            if (monoBlock) {
+                (this->*monoKernel)();
+            }
+        }
+        else if (audioRatePwm) {
+            updatePulsewidth();
         }
 
-        generateOutput();
+        if (monoBlock) {
+            // send the precomputed sample of this step in the block
+            const int step = 3 - loopCounter;
+            outputs[SAW_OUTPUT].setVoltage(monoSaw[step]);
+            outputs[SQUARE_OUTPUT].setVoltage(monoSqr[step]);
+            outputs[SINE_OUTPUT].setVoltage(monoSin[step]);
+            outputs[TRIANGLE_OUTPUT].setVoltage(monoTri[step]);
+        }
+        else {
+            generateOutput();
+        }
+    }
+
+    /*
+     * Recalculate detune offsets and pan gains of the unison sub-oscillators.
+     * Only called when one of the unison settings changes.
+     */
+    void updateUnison(int newUnison, float detune, float spread) {
+        if (newUnison != unison) {
+            // free running sub-oscillators start at random phases so they don't sum into one big spike
+            for (int bank = 0; bank < maxOscillatorBanks; ++bank) {
+                for (int lane = 0; lane < 4; ++lane) {
+                    phaseAccumulators[bank][lane] = newUnison > 1 ? random::uniform() : 0.f;
+                }
+            }
+        }
+        unison = newUnison;
+        unisonBanks = (unison + 3) / 4;
+        unisonDetuneParam = detune;
+        unisonSpreadParam = spread;
+        unisonStereoApplied = unisonStereo;
+
+        // keep the summed level of the uncorrelated sub-oscillators roughly constant
+        const float level = 1.f / std::sqrt((float) unison);
+        for (int i = 0; i < maxUnison; ++i) {
+            float pitchOffset = 0.f;
+            float gainLeft = 0.f;
+            float gainRight = 0.f;
+            if (i < unison) {
+                // spread sub-oscillators evenly between -1 and 1
+                float position = unison > 1 ? 2.f * i / (unison - 1) - 1.f : 0.f;
+                pitchOffset = position * detune / 12.f;
+                if (unisonStereoApplied) {
+                    // equal power panning, normalized so a centered sub-oscillator keeps unity gain
+                    float angle = (position * spread + 1.f) * float(M_PI) / 4.f;
+                    gainLeft = level * float(M_SQRT2) * std::cos(angle);
+                    gainRight = level * float(M_SQRT2) * std::sin(angle);
+                }
+                else {
+                    gainLeft = level;
+                    gainRight = level;
+                }
+            }
+            unisonDetune[i / 4][i % 4] = pitchOffset;
+            unisonGainLeft[i / 4][i % 4] = gainLeft;
+            unisonGainRight[i / 4][i % 4] = gainRight;
+        }
     }
 
     /*
@@ -103,176 +323,634 @@ struct VCO : Module {
      * since modulation inputs are only read every 4 samples, sending audio rate frequencies into these inputs might give wrong result
      */
     void processEvery4Samples(const ProcessArgs& args) {
+        activeMode = mode;
+        if (activeMode == FM_MODE) {
+            processFmEvery4Samples(args);
+            return;
+        }
+        if (activeMode == ADDITIVE_MODE) {
+            processAdditiveEvery4Samples(args);
+            return;
+        }
+
+        int newUnison = (int) params[UNISON_PARAM].getValue();
+        float detune = params[DETUNE_PARAM].getValue();
+        float spread = params[SPREAD_PARAM].getValue();
+        if (newUnison != unison || detune != unisonDetuneParam || spread != unisonSpreadParam || unisonStereo != unisonStereoApplied) {
+            updateUnison(newUnison, detune, spread);
+        }
+        bool stereo = unison > 1 && unisonStereoApplied;
+
         currentPolyphony = std::max(1, inputs[VOCT_INPUT].getChannels());
-        currentBanks = currentPolyphony / 4;
+        if (stereo) {
+            // left channels go first, right channels after them
+            currentPolyphony = std::min(currentPolyphony, maxPolyphony / 2);
+        }
+        voiceBanks = currentPolyphony / 4;
         if (currentPolyphony % 4) {
-            ++currentBanks;
+            ++voiceBanks;
         }
+        currentBanks = unison > 1 ? currentPolyphony * unisonBanks : voiceBanks;
 
         // set sync connected
         sync_connected = inputs[SYNC_INPUT].isConnected();
 
         // set output channels polyphony
-        outputs[SINE_OUTPUT].setChannels(currentPolyphony);
-        outputs[SAW_OUTPUT].setChannels(currentPolyphony);
-        outputs[SQUARE_OUTPUT].setChannels(currentPolyphony);
-        outputs[TRIANGLE_OUTPUT].setChannels(currentPolyphony);
+        int outputChannels = stereo ? 2 * currentPolyphony : currentPolyphony;
+        outputs[SINE_OUTPUT].setChannels(outputChannels);
+        outputs[SAW_OUTPUT].setChannels(outputChannels);
+        outputs[SQUARE_OUTPUT].setChannels(outputChannels);
+        outputs[TRIANGLE_OUTPUT].setChannels(outputChannels);
 
-        // check for connected outputs
-        outputSaw = outputs[SAW_OUTPUT].isConnected();
-        outputSin = outputs[SINE_OUTPUT].isConnected();
-        outputSqr = outputs[SQUARE_OUTPUT].isConnected();
-        outputTri = outputs[TRIANGLE_OUTPUT].isConnected();
+        // check for connected outputs and pick the matching output kernel
+        int newOutputMask = (outputs[SAW_OUTPUT].isConnected() ? SAW_MASK : 0)
+                | (outputs[SQUARE_OUTPUT].isConnected() ? SQR_MASK : 0)
+                | (outputs[SINE_OUTPUT].isConnected() ? SIN_MASK : 0)
+                | (outputs[TRIANGLE_OUTPUT].isConnected() ? TRI_MASK : 0);
+        if (newOutputMask != outputMask) {
+            outputMask = newOutputMask;
+            outputKernel = getOutputKernel(outputMask);
+            monoKernel = getMonoKernel(outputMask);
+        }
 
-        float pulseWidthParam = params[PULSE_PARAM].getValue();
-        float pulseModParam = params[PULSEMODPARAM_PARAM].getValue();
+        // sync and audio rate pulse width need the per sample path
+        monoBlock = currentPolyphony == 1 && unison == 1 && !sync_connected && !audioRatePwm;
 
-        // This number was determined by measuring sawtooth voltage offset
-        // It's what the offset would be at sample rate.
-        const float sawCorrect = -5.698;
-
-        // Set pulsewidth
-        pulsewidth = pulseWidthParam + inputs[PULSEMOD_INPUT].getVoltage() / 10.f * pulseModParam;
-        pulsewidth = clamp(pulsewidth, 0.01f, 1.f - 0.01f);
+        pulseWidthParam = params[PULSE_PARAM].getValue();
+        pulseModParam = params[PULSEMODPARAM_PARAM].getValue();
+        updatePulsewidth();
 
         // calculate pitch
         float_4 pitchParam = params[PITCH_PARAM].value;
         float fmParam = params[FMPARAM_PARAM].getValue();
-        for (int bank = 0; bank < currentBanks; ++bank) {
-            const int currentChannel = bank * 4;
+        const float_4 q = float(std::log2(261.626));       // move up to C
+        if (unison > 1) {
+            for (int voice = 0; voice < currentPolyphony; ++voice) {
+                float_4 voicePitch = pitchParam + inputs[VOCT_INPUT].getPolyVoltage(voice) - float_4(4.f) + q;
+                voicePitch += inputs[FM_INPUT].getPolyVoltage(voice) * fmParam;
+
+                for (int unisonBank = 0; unisonBank < unisonBanks; ++unisonBank) {
+                    setFrequency(voice * unisonBanks + unisonBank, voicePitch + unisonDetune[unisonBank], args.sampleTime);
+                }
+            }
+        }
+        else {
+            for (int bank = 0; bank < currentBanks; ++bank) {
+                const int currentChannel = bank * 4;
+
+                float_4 pitchCV = inputs[VOCT_INPUT].getPolyVoltageSimd<float_4>(currentChannel);
+                float_4 combinedPitch = pitchParam + pitchCV - float_4(4.f);
+
+                combinedPitch += q;
+                combinedPitch += inputs[FM_INPUT].getPolyVoltageSimd<float_4>(currentChannel) * fmParam;
+
+                setFrequency(bank, combinedPitch, args.sampleTime);
+            }
+        }
+    }
 
-            float_4 pitchCV = inputs[VOCT_INPUT].getPolyVoltageSimd<float_4>(currentChannel);
-            float_4 combinedPitch = pitchParam + pitchCV - float_4(4.f);
+    /*
+     * Read the FM operator settings and calculate the operator frequencies of every voice.
+     * Unison and the other waveforms are not used in FM mode.
+     */
+    void processFmEvery4Samples(const ProcessArgs& args) {
+        // modulators of every operator and the carriers, as bitmasks of operators
+        struct Algorithm {
+            int modulators[4];
+            int carriers;
+        };
+        static const Algorithm algorithms[8] = {
+            {{0x2, 0x4, 0x8, 0x0}, 0x1},
+            {{0x2, 0xc, 0x0, 0x0}, 0x1},
+            {{0xa, 0x4, 0x0, 0x0}, 0x1},
+            {{0x6, 0x8, 0x8, 0x0}, 0x1},
+            {{0x2, 0x0, 0x8, 0x0}, 0x5},
+            {{0x8, 0x8, 0x8, 0x0}, 0x7},
+            {{0x0, 0x0, 0x8, 0x0}, 0x7},
+            {{0x0, 0x0, 0x0, 0x0}, 0xf}
+        };
+        const Algorithm& algorithm = algorithms[clamp((int) params[ALGORITHM_PARAM].getValue(), 0, 7)];
 
-            const float_4 q = float(std::log2(261.626));       // move up to C
-            combinedPitch += q;
-            combinedPitch += inputs[FM_INPUT].getPolyVoltageSimd<float_4>(currentChannel) * fmParam;
+        int carrierCount = 0;
+        for (int op = 0; op < 4; ++op) {
+            for (int source = 0; source < 4; ++source) {
+                fmRouting[source][op] = (algorithm.modulators[op] >> source) & 1;
+            }
+            fmLevels[op] = params[LEVEL1_PARAM + op].getValue();
+            fmCarriers[op] = (algorithm.carriers >> op) & 1;
+            carrierCount += (algorithm.carriers >> op) & 1;
+        }
+        fmRouting[3][3] = 0.5f * params[FEEDBACK_PARAM].getValue();
+        fmCarriers /= float(carrierCount);
+
+        setSineOnlyOutputs();
+
+        float_4 ratios;
+        for (int op = 0; op < 4; ++op) {
+            ratios[op] = params[RATIO1_PARAM + op].getValue();
+        }
 
+        for (int voice = 0; voice < currentPolyphony; ++voice) {
+            fmAdvance[voice] = float_4(args.sampleTime * getVoiceFrequency(voice)) * ratios;
+        }
+    }
 
-            const float_4 freq = rack::dsp::approxExp2_taylor5<float_4>(combinedPitch);
+    /*
+     * Shared setup of the FM and additive modes, which only use the sine output
+     */
+    void setSineOnlyOutputs() {
+        currentPolyphony = std::max(1, inputs[VOCT_INPUT].getChannels());
+        monoBlock = false;
+        sync_connected = inputs[SYNC_INPUT].isConnected();
+        outputs[SINE_OUTPUT].setChannels(currentPolyphony);
+        outputs[SAW_OUTPUT].setChannels(1);
+        outputs[SQUARE_OUTPUT].setChannels(1);
+        outputs[TRIANGLE_OUTPUT].setChannels(1);
+        outputs[SAW_OUTPUT].setVoltage(0.f);
+        outputs[SQUARE_OUTPUT].setVoltage(0.f);
+        outputs[TRIANGLE_OUTPUT].setVoltage(0.f);
+    }
 
-            const float_4 normalizedFreq = float_4(args.sampleTime) * freq;
-            phaseAdvance[bank] = normalizedFreq;
+    /*
+     * Frequency in Hz of a single voice, from the pitch knob, 1V/octave and FM inputs
+     */
+    float getVoiceFrequency(int voice) {
+        const float q = float(std::log2(261.626));       // move up to C
+        float combinedPitch = params[PITCH_PARAM].getValue() + inputs[VOCT_INPUT].getPolyVoltage(voice) - 4.f + q;
+        combinedPitch += inputs[FM_INPUT].getPolyVoltage(voice) * params[FMPARAM_PARAM].getValue();
+        return rack::dsp::approxExp2_taylor5(combinedPitch);
+    }
 
-            dcOffsetCompensation[bank] = normalizedFreq * float_4(sawCorrect);
+    /*
+     * Put all partial phasors back at phase 0
+     */
+    void resetPartials() {
+        for (int voice = 0; voice < maxPolyphony; ++voice) {
+            for (int bank = 0; bank < maxPartialBanks; ++bank) {
+                partialCos[voice][bank] = 1.f;
+                partialSin[voice][bank] = 0.f;
+            }
         }
     }
 
-    void generateOutput() {
-        for (int bank = 0; bank < currentBanks; ++bank) {
-            const int baseChannel = bank * 4;
-            const int relativeChannel = currentPolyphony - baseChannel;
-
-            // advance phase and wrap
-            phaseAccumulators[bank] += phaseAdvance[bank];
-            phaseAccumulators[bank] -= simd::floor(phaseAccumulators[bank]);
-
-            // sync
-            if (sync_connected) {
-                // get sync
-                float sync_in = inputs[SYNC_INPUT].getVoltage();
-
-                if (sync_in >=0 && sync_prev < 0) {
-                    // if sync has crossed over, set all phases to 0
-                    for (int i=0; i<maxBanks; i++){
-                        phaseAccumulators[i] = 0.f;
+    /*
+     * Recalculate the partial amplitudes, from the tilt and even controls or from the partial table.
+     * The sum of all amplitudes is limited to 2, which keeps the output within 10V.
+     */
+    void updatePartialAmplitudes() {
+        float amplitudes[maxPartials];
+        float total = 0.f;
+        for (int i = 0; i < maxPartials; ++i) {
+            const int harmonic = i + 1;
+            float amplitude = 0.f;
+            if (i < partialCount) {
+                if (usePartialTable) {
+                    amplitude = partialTable[i];
+                }
+                else {
+                    amplitude = std::pow((float) harmonic, -partialTilt);
+                    if (harmonic % 2 == 0) {
+                        amplitude *= partialEven;
                     }
                 }
+            }
+            amplitudes[i] = amplitude;
+            total += std::fabs(amplitude);
+        }
 
-                // update sync
-                sync_prev = sync_in;
+        const float scale = 1.f / std::max(1.f, total / 2.f);
+        for (int i = 0; i < maxPartials; ++i) {
+            partialAmplitudes[i / 4][i % 4] = amplitudes[i] * scale;
+        }
+    }
+
+    /*
+     * Read the additive settings and calculate the phasor rotation of every audible partial of every voice
+     */
+    void processAdditiveEvery4Samples(const ProcessArgs& args) {
+        setSineOnlyOutputs();
+
+        int newPartialCount = (int) params[PARTIALS_PARAM].getValue();
+        float tilt = params[TILT_PARAM].getValue();
+        float even = params[EVEN_PARAM].getValue();
+        if (partialsChanged || newPartialCount != partialCount || tilt != partialTilt || even != partialEven) {
+            partialsChanged = false;
+            partialCount = newPartialCount;
+            partialTilt = tilt;
+            partialEven = even;
+            updatePartialAmplitudes();
+        }
+
+        for (int voice = 0; voice < currentPolyphony; ++voice) {
+            const double normalizedFreq = args.sampleTime * getVoiceFrequency(voice);
+
+            // only partials below nyquist are generated
+            int audible = std::min(partialCount, (int) (0.5 / normalizedFreq));
+            audibleBanks[voice] = (audible + 3) / 4;
+            if (audible == 0) {
+                continue;
             }
+            const int lastBank = audibleBanks[voice] - 1;
+            lastBankAmplitudes[voice] = partialAmplitudes[lastBank] & simd::movemaskInverse<float_4>((1 << (audible - lastBank * 4)) - 1);
 
+            // rotations of the first 4 partials, in double so high partials stay in tune
+            const double angle = 2 * M_PI * normalizedFreq;
+            double c = std::cos(angle);
+            double s = std::sin(angle);
+            double ck = c;
+            double sk = s;
+            for (int k = 0; k < 4; ++k) {
+                rotationCos[voice][0][k] = ck;
+                rotationSin[voice][0][k] = sk;
+                const double nextCos = ck * c - sk * s;
+                sk = sk * c + ck * s;
+                ck = nextCos;
+            }
 
-            float_4 SawMinBlepValue;
-            if (outputSaw) {
-                // Evaluate the phase, and determine if we are at a discontinuity.
-                // Determine if the saw "should have" already crossed .5V in the last sample period
-                float_4 halfCrossing = (0.5f - (phaseAccumulators[bank] -  phaseAdvance[bank])) /  phaseAdvance[bank];
-                int halfMask = simd::movemask((0 < halfCrossing) & (halfCrossing <= 1.f));
-                if (halfMask) {
-                    for (int subChannel=0; subChannel < relativeChannel; ++subChannel) {
-                        if (halfMask & (1 << subChannel)) {
-                            float_4 mask = simd::movemaskInverse<float_4>(1 << subChannel);
-                            float jumpPhase = halfCrossing[subChannel] - 1.f;
-                            float_4 jumpAmount = mask & -2.f;
-                            sawMinBlep[bank].insertDiscontinuity(jumpPhase, jumpAmount);
-                        }
-                    }
-                }
-                SawMinBlepValue = sawMinBlep[bank].process();
+            // every next bank rotates 4 harmonics further
+            const float_4 cos4 = rotationCos[voice][0][3];
+            const float_4 sin4 = rotationSin[voice][0][3];
+            for (int bank = 1; bank < audibleBanks[voice]; ++bank) {
+                rotationCos[voice][bank] = rotationCos[voice][bank - 1] * cos4 - rotationSin[voice][bank - 1] * sin4;
+                rotationSin[voice][bank] = rotationSin[voice][bank - 1] * cos4 + rotationCos[voice][bank - 1] * sin4;
             }
 
-            float_4 sqrMinBlepValue;
-            if (outputSqr) {
-                // jump square when crossing 0
-                float_4 wrapCrossing = (- (phaseAccumulators[bank] -  phaseAdvance[bank])) /  phaseAdvance[bank];
-                int halfmask = simd::movemask((0<wrapCrossing) & (wrapCrossing <= 1.f));
-                if (halfmask) {
-                    for (int subChannel = 0; subChannel<relativeChannel; ++subChannel){
-                        float_4 mask = simd::movemaskInverse<float_4>(1 << subChannel);
-                        float jumpPhase = wrapCrossing[subChannel] - 1.f;
-                        float_4 jumpAmount = mask & -2.f;
-                        sqrMinBlep[bank].insertDiscontinuity(jumpPhase, jumpAmount);
-                    }
+            // pull the phasors back onto the unit circle, rounding errors would otherwise make them drift
+            for (int bank = 0; bank < audibleBanks[voice]; ++bank) {
+                float_4 gain = (3.f - (partialCos[voice][bank] * partialCos[voice][bank] + partialSin[voice][bank] * partialSin[voice][bank])) * 0.5f;
+                partialCos[voice][bank] *= gain;
+                partialSin[voice][bank] *= gain;
+            }
+        }
+    }
+
+    /*
+     * Generate the additive voices by rotating the phasor of every audible partial
+     */
+    void generateAdditive() {
+        for (int voice = 0; voice < currentPolyphony; ++voice) {
+            const int banks = audibleBanks[voice];
+            float_4 mix = 0.f;
+            for (int bank = 0; bank < banks; ++bank) {
+                const float_4 c = partialCos[voice][bank];
+                const float_4 s = partialSin[voice][bank];
+                partialCos[voice][bank] = c * rotationCos[voice][bank] - s * rotationSin[voice][bank];
+                partialSin[voice][bank] = s * rotationCos[voice][bank] + c * rotationSin[voice][bank];
+                mix += partialSin[voice][bank] * (bank == banks - 1 ? lastBankAmplitudes[voice] : partialAmplitudes[bank]);
+            }
+            outputs[SINE_OUTPUT].setVoltage(5.f * (mix[0] + mix[1] + mix[2] + mix[3]), voice);
+        }
+    }
+
+    /*
+     * Fill the partial table from a list of amplitudes separated by commas, spaces or newlines
+     */
+    void setPartialTable(const char* text) {
+        for (int i = 0; i < maxPartials; ++i) {
+            partialTable[i] = 0.f;
+        }
+        char* end = NULL;
+        for (int i = 0; i < maxPartials && text; ++i) {
+            while (*text == ',' || *text == ';' || *text == ' ' || *text == '\t' || *text == '\r' || *text == '\n') {
+                ++text;
+            }
+            float amplitude = std::strtof(text, &end);
+            if (end == text) {
+                break;
+            }
+            partialTable[i] = amplitude;
+            text = end;
+        }
+        usePartialTable = true;
+        partialsChanged = true;
+    }
+
+    /*
+     * Generate the FM voices, all 4 operators of a voice in one vector.
+     * Every operator is modulated by last sample's operator outputs through the routing matrix.
+     */
+    void generateFm() {
+        const static float twoPi = 2 * 3.141592653589793238;
+        for (int voice = 0; voice < currentPolyphony; ++voice) {
+            const float_4 out = fmOutputs[voice];
+            float_4 modulation = fmRouting[0] * out[0] + fmRouting[1] * out[1] + fmRouting[2] * out[2] + fmRouting[3] * out[3];
+
+            fmPhases[voice] += fmAdvance[voice];
+            fmPhases[voice] -= simd::floor(fmPhases[voice]);
+            float_4 phase = fmPhases[voice] + modulation;
+            phase -= simd::floor(phase);
+
+            fmOutputs[voice] = sinTwoPi(phase * twoPi) * fmLevels;
+            float_4 mix = fmOutputs[voice] * fmCarriers;
+            outputs[SINE_OUTPUT].setVoltage(5.f * (mix[0] + mix[1] + mix[2] + mix[3]), voice);
+        }
+    }
+
+    /*
+     * Read the pulse width of every voice, called every sample when audio rate pulse width modulation is enabled
+     */
+    void updatePulsewidth() {
+        for (int bank = 0; bank < voiceBanks; ++bank) {
+            float_4 pulseCV = inputs[PULSEMOD_INPUT].getPolyVoltageSimd<float_4>(bank * 4);
+            pulsewidth[bank] = simd::clamp(pulseWidthParam + pulseCV / 10.f * pulseModParam, 0.01f, 1.f - 0.01f);
+        }
+    }
+
+    /*
+     * Convert a pitch in volts to the phase advance of a bank
+     */
+    void setFrequency(int bank, float_4 combinedPitch, float sampleTime) {
+        // This number was determined by measuring sawtooth voltage offset
+        // It's what the offset would be at sample rate.
+        const float sawCorrect = -5.698;
+
+        const float_4 freq = rack::dsp::approxExp2_taylor5<float_4>(combinedPitch);
+
+        const float_4 normalizedFreq = float_4(sampleTime) * freq;
+        phaseAdvance[bank] = normalizedFreq;
+
+        dcOffsetCompensation[bank] = normalizedFreq * float_4(sawCorrect);
+    }
+
+    void generateOutput() {
+        // sync
+        if (sync_connected) {
+            // get sync
+            float sync_in = inputs[SYNC_INPUT].getVoltage();
+
+            if (sync_in >=0 && sync_prev < 0) {
+                // if sync has crossed over, set all phases to 0
+                for (int i=0; i<currentBanks; i++){
+                    phaseAccumulators[i] = 0.f;
+                }
+                for (int i = 0; i < maxPolyphony; i++) {
+                    fmPhases[i] = 0.f;
                 }
+                if (activeMode == ADDITIVE_MODE) {
+                    resetPartials();
+                }
+            }
 
-                // jump square when crossing pulse width
-                float_4 pulseCrossing = (pulsewidth - (phaseAccumulators[bank] - phaseAdvance[bank])) / phaseAdvance[bank];
-                int pulseJump = simd::movemask((0 < pulseCrossing) & (pulseCrossing <= 1.f));
-                if (pulseJump) {
-                    for (int subChannel=0; subChannel < relativeChannel; ++subChannel){
-                        float_4 mask = simd::movemaskInverse<float_4>(1 << subChannel);
-                        float jumpPhase = pulseCrossing[subChannel] - 1.f;
-                        float_4 jumpAmount = mask & -2.f;
-                        sqrMinBlep[bank].insertDiscontinuity(jumpPhase, jumpAmount);
-                    }
+            // update sync
+            sync_prev = sync_in;
+        }
+
+        if (activeMode == FM_MODE) {
+            generateFm();
+            return;
+        }
+        if (activeMode == ADDITIVE_MODE) {
+            generateAdditive();
+            return;
+        }
+
+        (this->*outputKernel)();
+    }
+
+    /*
+     * Look up the output kernel specialized for a combination of connected outputs
+     */
+    static OutputKernel getOutputKernel(int mask) {
+        static const OutputKernel kernels[16] = {
+            &VCO::generateOutputKernel<0>, &VCO::generateOutputKernel<1>, &VCO::generateOutputKernel<2>, &VCO::generateOutputKernel<3>,
+            &VCO::generateOutputKernel<4>, &VCO::generateOutputKernel<5>, &VCO::generateOutputKernel<6>, &VCO::generateOutputKernel<7>,
+            &VCO::generateOutputKernel<8>, &VCO::generateOutputKernel<9>, &VCO::generateOutputKernel<10>, &VCO::generateOutputKernel<11>,
+            &VCO::generateOutputKernel<12>, &VCO::generateOutputKernel<13>, &VCO::generateOutputKernel<14>, &VCO::generateOutputKernel<15>
+        };
+        return kernels[mask];
+    }
+
+    /*
+     * Look up the mono block kernel specialized for a combination of connected outputs
+     */
+    static OutputKernel getMonoKernel(int mask) {
+        static const OutputKernel kernels[16] = {
+            &VCO::generateMonoBlock<0>, &VCO::generateMonoBlock<1>, &VCO::generateMonoBlock<2>, &VCO::generateMonoBlock<3>,
+            &VCO::generateMonoBlock<4>, &VCO::generateMonoBlock<5>, &VCO::generateMonoBlock<6>, &VCO::generateMonoBlock<7>,
+            &VCO::generateMonoBlock<8>, &VCO::generateMonoBlock<9>, &VCO::generateMonoBlock<10>, &VCO::generateMonoBlock<11>,
+            &VCO::generateMonoBlock<12>, &VCO::generateMonoBlock<13>, &VCO::generateMonoBlock<14>, &VCO::generateMonoBlock<15>
+        };
+        return kernels[mask];
+    }
+
+    /*
+     * Generate the next 4 samples of a single voice, one sample per lane, in -5v / 5v.
+     * The phase advance is constant over the block, so the phases of all 4 samples follow from a prefix sum.
+     * Only the minblep generators still run once per sample.
+     */
+    template <int MASK>
+    void generateMonoBlock() {
+        const float advance = phaseAdvance[0][0];
+        const float pw = pulsewidth[0][0];
+
+        // phase of each sample in the block, and the (unwrapped) phase of the sample before it
+        float_4 phase = phaseAccumulators[0][0] + float_4(1.f, 2.f, 3.f, 4.f) * advance;
+        phase -= simd::floor(phase);
+        const float_4 lastPhase = phase - advance;
+        phaseAccumulators[0] = phase[3];
+
+        if (MASK & SAW_MASK) {
+            // half crossings of the saw, for each sample in the block
+            float_4 halfCrossing = (0.5f - lastPhase) / advance;
+            int halfMask = simd::movemask((0 < halfCrossing) & (halfCrossing <= 1.f));
+
+            float_4 rawSaw = phase + float_4(.5f);
+            rawSaw -= simd::trunc(rawSaw);
+            rawSaw = 2 * rawSaw - 1 + dcOffsetCompensation[0][0];
+
+            for (int step = 0; step < 4; ++step) {
+                if (halfMask & (1 << step)) {
+                    monoSawMinBlep.insertDiscontinuity(halfCrossing[step] - 1.f, -2.f);
                 }
+                rawSaw[step] += monoSawMinBlep.process();
+            }
+            monoSaw = float_4(5) * rawSaw;
+        }
+
+        if (MASK & SQR_MASK) {
+            float_4 rawSqr = simd::ifelse(phase < pw, 1.f, -1.f);
 
-                sqrMinBlepValue = sqrMinBlep[bank].process();
+            // the square value of the sample before each sample in the block
+            float_4 previousSqr(lastSqr[0][0], rawSqr[0], rawSqr[1], rawSqr[2]);
+            float_4 jump = rawSqr - previousSqr;
+            int jumpMask = simd::movemask(jump != 0.f);
+            float_4 crossing = simd::clamp(simd::ifelse(lastPhase < 0.f, -lastPhase, pw - lastPhase) / advance, 0.f, 1.f);
+            lastSqr[0] = rawSqr[3];
+            lastPulsewidth[0] = pw;
+
+            for (int step = 0; step < 4; ++step) {
+                if (jumpMask & (1 << step)) {
+                    monoSqrMinBlep.insertDiscontinuity(crossing[step] - 1.f, jump[step]);
+                }
+                rawSqr[step] += monoSqrMinBlep.process();
             }
+            monoSqr = float_4(5) * rawSqr;
+        }
 
-            if (outputSaw) {
-                // generate raw saw signal
-                float_4 rawSaw = phaseAccumulators[bank] + float_4(.5f);
-                rawSaw -= simd::trunc(rawSaw);
-                rawSaw = 2 * rawSaw - 1;
+        if (MASK & SIN_MASK) {
+            const static float twoPi = 2 * 3.141592653589793238;
+            monoSin = float_4(5.f) * sinTwoPi(phase * twoPi);
+        }
+
+        if (MASK & TRI_MASK) {
+            float_4 rawSaw = (phase - 0.5)*2;
+            monoTri = float_4(5) * ((abs(rawSaw) * 2) - 1);
+        }
+    }
+
+    /*
+     * Generate all banks for one combination of connected outputs.
+     * MASK is known at compile time, so the checks on it leave no branches in the loops.
+     */
+    template <int MASK>
+    void generateOutputKernel() {
+        float_4 saw, sqr, sin, tri;
 
-                // add antialiassing minblep
-                rawSaw += SawMinBlepValue;
-                rawSaw += dcOffsetCompensation[bank];
+        if (unison == 1) {
+            for (int bank = 0; bank < currentBanks; ++bank) {
+                const int baseChannel = bank * 4;
+                generateBank<MASK>(bank, std::min(4, currentPolyphony - baseChannel), pulsewidth[bank], saw, sqr, sin, tri);
 
                 // transform from -1v / 1v to -5v / 5v and send to output
-                float_4 sawWave = float_4(5) * rawSaw;
-                outputs[SAW_OUTPUT].setVoltageSimd(sawWave, baseChannel);
+                if (MASK & SAW_MASK)
+                    outputs[SAW_OUTPUT].setVoltageSimd(float_4(5) * saw, baseChannel);
+                if (MASK & SQR_MASK)
+                    outputs[SQUARE_OUTPUT].setVoltageSimd(float_4(5) * sqr, baseChannel);
+                if (MASK & SIN_MASK)
+                    outputs[SINE_OUTPUT].setVoltageSimd(float_4(5) * sin, baseChannel);
+                if (MASK & TRI_MASK)
+                    outputs[TRIANGLE_OUTPUT].setVoltageSimd(float_4(5) * tri, baseChannel);
             }
+            return;
+        }
 
-            if (outputSqr) {
-                // generate raw square signal
-                float_4 rawSqr = simd::ifelse(phaseAccumulators[bank] < pulsewidth, 1.f, -1.f);
+        // unison: mix the sub-oscillators of every voice down to one (or two when stereo) channels
+        for (int voice = 0; voice < currentPolyphony; ++voice) {
+            float_4 sawLeft = 0.f, sawRight = 0.f;
+            float_4 sqrLeft = 0.f, sqrRight = 0.f;
+            float_4 sinLeft = 0.f, sinRight = 0.f;
+            float_4 triLeft = 0.f, triRight = 0.f;
+            const float_4 voicePulsewidth = pulsewidth[voice / 4][voice % 4];
 
-                // add minblep antialiassing
-                rawSqr += sqrMinBlepValue;
+            for (int unisonBank = 0; unisonBank < unisonBanks; ++unisonBank) {
+                generateBank<MASK>(voice * unisonBanks + unisonBank, std::min(4, unison - unisonBank * 4), voicePulsewidth, saw, sqr, sin, tri);
 
-                // transform from -1v / 1v to -5v / 5v and send to output
-                float_4 sqrWave = float_4(5) * rawSqr;
-                outputs[SQUARE_OUTPUT].setVoltageSimd(sqrWave, baseChannel);
+                const float_4 gainLeft = unisonGainLeft[unisonBank];
+                const float_4 gainRight = unisonGainRight[unisonBank];
+                if (MASK & SAW_MASK) {
+                    sawLeft += saw * gainLeft;
+                    sawRight += saw * gainRight;
+                }
+                if (MASK & SQR_MASK) {
+                    sqrLeft += sqr * gainLeft;
+                    sqrRight += sqr * gainRight;
+                }
+                if (MASK & SIN_MASK) {
+                    sinLeft += sin * gainLeft;
+                    sinRight += sin * gainRight;
+                }
+                if (MASK & TRI_MASK) {
+                    triLeft += tri * gainLeft;
+                    triRight += tri * gainRight;
+                }
             }
 
-            if (outputSin) {
-                const static float twoPi = 2 * 3.141592653589793238;
-                float_4 sinWave = float_4(5.f) * sinTwoPi( phaseAccumulators[bank] * twoPi);
-                outputs[SINE_OUTPUT].setVoltageSimd(sinWave, baseChannel);
+            if (MASK & SAW_MASK)
+                setUnisonVoltage(SAW_OUTPUT, voice, sawLeft, sawRight);
+            if (MASK & SQR_MASK)
+                setUnisonVoltage(SQUARE_OUTPUT, voice, sqrLeft, sqrRight);
+            if (MASK & SIN_MASK)
+                setUnisonVoltage(SINE_OUTPUT, voice, sinLeft, sinRight);
+            if (MASK & TRI_MASK)
+                setUnisonVoltage(TRIANGLE_OUTPUT, voice, triLeft, triRight);
+        }
+    }
+
+    /*
+     * Sum the lanes of a unison mix and send them to the output, right channels follow the left ones
+     */
+    void setUnisonVoltage(int output, int voice, float_4 left, float_4 right) {
+        outputs[output].setVoltage(5.f * (left[0] + left[1] + left[2] + left[3]), voice);
+        if (unisonStereoApplied) {
+            outputs[output].setVoltage(5.f * (right[0] + right[1] + right[2] + right[3]), voice + currentPolyphony);
+        }
+    }
+
+    /*
+     * Advance a single bank of oscillators and generate its -1v / 1v waveforms.
+     * Waveforms missing from MASK are left untouched.
+     */
+    template <int MASK>
+    void generateBank(int bank, int lanes, float_4 pw, float_4& saw, float_4& sqr, float_4& sin, float_4& tri) {
+        // advance phase and wrap
+        phaseAccumulators[bank] += phaseAdvance[bank];
+        phaseAccumulators[bank] -= simd::floor(phaseAccumulators[bank]);
+
+        if (MASK & SAW_MASK) {
+            // Evaluate the phase, and determine if we are at a discontinuity.
+            // Determine if the saw "should have" already crossed .5V in the last sample period
+            float_4 halfCrossing = (0.5f - (phaseAccumulators[bank] -  phaseAdvance[bank])) /  phaseAdvance[bank];
+            int halfMask = simd::movemask((0 < halfCrossing) & (halfCrossing <= 1.f));
+            if (halfMask) {
+                for (int subChannel=0; subChannel < lanes; ++subChannel) {
+                    if (halfMask & (1 << subChannel)) {
+                        float_4 mask = simd::movemaskInverse<float_4>(1 << subChannel);
+                        float jumpPhase = halfCrossing[subChannel] - 1.f;
+                        float_4 jumpAmount = mask & -2.f;
+                        sawMinBlep[bank].insertDiscontinuity(jumpPhase, jumpAmount);
+                    }
+                }
             }
 
-            if (outputTri) {
-                // generate triangle wave based on saw wave
-                float_4 saw = (phaseAccumulators[bank] - 0.5)*2;
-                float_4 triangle = (abs(saw) * 2) - 1;
+            // generate raw saw signal
+            float_4 rawSaw = phaseAccumulators[bank] + float_4(.5f);
+            rawSaw -= simd::trunc(rawSaw);
+            rawSaw = 2 * rawSaw - 1;
+
+            // add antialiassing minblep
+            rawSaw += sawMinBlep[bank].process();
+            rawSaw += dcOffsetCompensation[bank];
+            saw = rawSaw;
+        }
+
+        if (MASK & SQR_MASK) {
+            // generate raw square signal
+            float_4 rawSqr = simd::ifelse(phaseAccumulators[bank] < pw, 1.f, -1.f);
 
-                // send to output
-                outputs[TRIANGLE_OUTPUT].setVoltageSimd(triangle * float_4(5), bank);
+            // jump square wherever it changed since last sample, at the wrap or where phase and pulse width crossed.
+            // The pulse width may move every sample, so the crossing is found from the distance between both.
+            float_4 jump = rawSqr - lastSqr[bank];
+            int jumpMask = simd::movemask(jump != 0.f);
+            if (jumpMask) {
+                float_4 lastPhase = phaseAccumulators[bank] - phaseAdvance[bank];
+                float_4 wrapCrossing = -lastPhase / phaseAdvance[bank];
+                float_4 lastDistance = lastPhase - lastPulsewidth[bank];
+                float_4 pulseCrossing = lastDistance / (lastDistance - (phaseAccumulators[bank] - pw));
+                float_4 crossing = simd::clamp(simd::ifelse(lastPhase < 0.f, wrapCrossing, pulseCrossing), 0.f, 1.f);
+                for (int subChannel = 0; subChannel < lanes; ++subChannel) {
+                    if (jumpMask & (1 << subChannel)) {
+                        float_4 mask = simd::movemaskInverse<float_4>(1 << subChannel);
+                        float jumpPhase = crossing[subChannel] - 1.f;
+                        sqrMinBlep[bank].insertDiscontinuity(jumpPhase, mask & jump);
+                    }
+                }
             }
+            lastSqr[bank] = rawSqr;
+            lastPulsewidth[bank] = pw;
+
+            // add minblep antialiassing
+            sqr = rawSqr + sqrMinBlep[bank].process();
+        }
+
+        if (MASK & SIN_MASK) {
+            const static float twoPi = 2 * 3.141592653589793238;
+            sin = sinTwoPi(phaseAccumulators[bank] * twoPi);
+        }
+
+        if (MASK & TRI_MASK) {
+            // generate triangle wave based on saw wave
+            float_4 rawSaw = (phaseAccumulators[bank] - 0.5)*2;
+            tri = (abs(rawSaw) * 2) - 1;
         }
     }
 
@@ -304,6 +982,48 @@ struct VCOWidget : ModuleWidget {
 		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(36.484, 108.95)), module, VCO::SAW_OUTPUT));
 		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(48.578, 108.95)), module, VCO::SQUARE_OUTPUT));
 	}
+
+    /*
+     * Add mode, unison, pulse width, FM and additive settings to module context window
+     */
+    void appendContextMenu(Menu* menu) override {
+        VCO* module = getModule<VCO>();
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createIndexPtrSubmenuItem("Mode", {"Subtractive", "FM (sine output)", "Additive (sine output)"}, &module->mode));
+        menu->addChild(createSubmenuItem("FM operators", "", [=](Menu* menu) {
+            menu->addChild(new GL_MenuSlider(module->paramQuantities[VCO::ALGORITHM_PARAM]));
+            menu->addChild(new GL_MenuSlider(module->paramQuantities[VCO::FEEDBACK_PARAM]));
+            for (int i = 0; i < 4; ++i) {
+                menu->addChild(new MenuSeparator);
+                menu->addChild(new GL_MenuSlider(module->paramQuantities[VCO::RATIO1_PARAM + i]));
+                menu->addChild(new GL_MenuSlider(module->paramQuantities[VCO::LEVEL1_PARAM + i]));
+            }
+        }));
+        menu->addChild(createSubmenuItem("Additive partials", "", [=](Menu* menu) {
+            menu->addChild(new GL_MenuSlider(module->paramQuantities[VCO::PARTIALS_PARAM]));
+            menu->addChild(new GL_MenuSlider(module->paramQuantities[VCO::TILT_PARAM]));
+            menu->addChild(new GL_MenuSlider(module->paramQuantities[VCO::EVEN_PARAM]));
+            menu->addChild(createCheckMenuItem("Use partial table", "",
+                [=]() { return module->usePartialTable; },
+                [=]() { module->usePartialTable ^= true; module->partialsChanged = true; }
+            ));
+            menu->addChild(createMenuItem("Paste partial table from clipboard", "", [=]() {
+                module->setPartialTable(glfwGetClipboardString(APP->window->win));
+            }));
+        }));
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createMenuLabel("Unison"));
+        menu->addChild(new GL_MenuSlider(module->paramQuantities[VCO::UNISON_PARAM]));
+        menu->addChild(new GL_MenuSlider(module->paramQuantities[VCO::DETUNE_PARAM]));
+        menu->addChild(new GL_MenuSlider(module->paramQuantities[VCO::SPREAD_PARAM]));
+        menu->addChild(createBoolPtrMenuItem("Stereo (left 1-8, right 9-16)", "", &module->unisonStereo));
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createMenuLabel("Pulse width"));
+        menu->addChild(createBoolPtrMenuItem("Audio rate pulse width modulation", "", &module->audioRatePwm));
+    }
 };
 
 
@@ -1,14 +1,150 @@
 #include "plugin.hpp"
+#include "wavfile.hpp"
+#include <osdialog.h>
 #include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include "stdio.h"
 
+using float_4 = simd::float_4;
 static const int maxPolyphony = 16;
+static const int maxBanks = maxPolyphony / 4;
+
+// The drawing is resampled to this many points before the band limited versions are made.
+// A power of two, so indices wrap around with a mask
+static const int mipSize = 1024;
+// Every level repeats the last point before the cycle and the first two after it,
+// so the four interpolation points are always next to each other in memory
+static const int guardPoints = 3;
+// One band limited version per octave, level k keeps the lowest mipSize / 2 >> k harmonics
+static const int mipLevels = 10;
+// Wavetable files without a frame size hold frames of the standard 2048 samples
+static const int wavetableCycle = 2048;
+static const int maxFrames = 256;
+
+// Saved drawings are a version byte and a little endian 32 bit point count,
+// followed by every point quantized to 16 bits, little endian, the whole blob base64 encoded
+static const uint8_t drawingVersion = 1;
+static const int drawingHeaderSize = 5;
+static const uint32_t maxDrawingPoints = 1 << 16;
+
+/*
+ * Band limited versions of one cycle
+ */
+struct MipFrame {
+    float levels[mipLevels][mipSize + guardPoints];
+};
+
+/*
+ * A wavetable loaded from a file, shared by every module playing that file and never changed once built
+ */
+struct Wavetable {
+    std::vector<MipFrame> frames;
+};
+
+/*
+ * What the audio thread plays, the band limited drawing or the frames of a loaded wavetable.
+ * Once published to the audio thread a table is never written again until the audio thread retires it
+ */
+struct MipTables {
+    MipFrame drawing;
+    // Keeps a loaded wavetable alive while it is played
+    std::shared_ptr<const Wavetable> wavetable;
+    const MipFrame* frames = nullptr;
+    int frameCount = 0;
+    // Samples to crossfade over when the audio thread switches to this table
+    int fadeSamples = 0;
+};
+
+// Loaded wavetables by path, so modules playing the same file share one copy
+static std::mutex wavetableCacheMutex;
+static std::map<std::string, std::weak_ptr<const Wavetable>> wavetableCache;
+
+/*
+ * Number of harmonics a mip level keeps
+ */
+static int levelHarmonics(int level) {
+    return std::min((mipSize / 2) >> level, mipSize / 2 - 1);
+}
+
+/*
+ * Write one band limited level of a cycle, with its guard points.
+ * The spectrum is laid out like the ordered output of a mipSize point RealFFT, bin 0 holds DC, bin 1 nyquist and bins 2k and 2k+1 harmonic k
+ */
+static void buildLevel(dsp::RealFFT& fft, const float* spectrum, int level, float* guarded) {
+    alignas(16) float levelSpectrum[mipSize];
+    alignas(16) float cycle[mipSize];
+    std::copy(spectrum, spectrum + mipSize, levelSpectrum);
+    levelSpectrum[1] = 0.f;
+    std::fill(levelSpectrum + 2 * (levelHarmonics(level) + 1), levelSpectrum + mipSize, 0.f);
+    fft.irfft(levelSpectrum, cycle);
+    fft.scale(cycle);
+
+    guarded[0] = cycle[mipSize - 1];
+    std::copy(cycle, cycle + mipSize, guarded + 1);
+    guarded[mipSize + 1] = cycle[0];
+    guarded[mipSize + 2] = cycle[1];
+}
+
+/*
+ * Band limit every frame of a wavetable file. Takes a while, so it runs on a background thread
+ */
+static std::shared_ptr<const Wavetable> buildWavetable(const WavFile& wav) {
+    // a file shorter than one frame is a single cycle
+    size_t cycleLength = wav.cycleLength > 0 ? wav.cycleLength : wavetableCycle;
+    cycleLength = std::min(cycleLength, wav.length);
+    size_t frameCount = std::min<size_t>(wav.length / cycleLength, maxFrames);
+
+    std::shared_ptr<Wavetable> wavetable = std::make_shared<Wavetable>();
+    wavetable->frames.resize(frameCount);
+    dsp::RealFFT cycleFft(2 * mipSize);
+    dsp::RealFFT levelFft(mipSize);
+    alignas(16) float cycle[2 * mipSize];
+    alignas(16) float cycleSpectrum[2 * mipSize];
+    for (size_t frame = 0; frame < frameCount; ++frame) {
+        // resample the frame to twice the mip resolution, in the 0..1 range of the drawing
+        size_t start = frame * cycleLength;
+        for (int i = 0; i < 2 * mipSize; ++i) {
+            double position = double(i) * cycleLength / (2 * mipSize);
+            size_t index = size_t(position);
+            float frac = position - index;
+            float value = crossfade(wav.sample(start + index), wav.sample(start + (index + 1) % cycleLength), frac);
+            cycle[i] = 0.5f * value + 0.5f;
+        }
+
+        // the lower half of the spectrum, at half the scale, is the spectrum at mip resolution
+        cycleFft.rfft(cycle, cycleSpectrum);
+        for (int i = 0; i < mipSize; ++i) {
+            cycleSpectrum[i] *= 0.5f;
+        }
+        for (int level = 0; level < mipLevels; ++level) {
+            buildLevel(levelFft, cycleSpectrum, level, wavetable->frames[frame].levels[level]);
+        }
+    }
+    return wavetable;
+}
+
+/*
+ * Load the four interpolation points of every lane, lane i reads rows[i] from index[i] on
+ */
+static inline void loadPoints(const float* const* rows, simd::int32_4 index, float_4& a, float_4& b, float_4& c, float_4& d) {
+    // SSE has no gather, every lane loads its four neighbours at once and the loads are transposed into a, b, c and d
+    a = float_4::load(rows[0] + index[0]);
+    b = float_4::load(rows[1] + index[1]);
+    c = float_4::load(rows[2] + index[2]);
+    d = float_4::load(rows[3] + index[3]);
+    _MM_TRANSPOSE4_PS(a.v, b.v, c.v, d.v);
+}
 
 
 struct WAVECRAFTER : Module {
 	enum ParamId {
         FREQ_PARAM,
 		FMPARAM_PARAM,
+		POSITION_PARAM,
 		PARAMS_LEN
 	};
 	enum InputId {
@@ -24,12 +160,49 @@ struct WAVECRAFTER : Module {
 		LIGHTS_LEN
 	};
 
+    // The drawing, only touched by the UI thread
     std::vector<float> buffer;
 
+    // Band limited versions of the drawing are built by the UI thread and handed over through publishedTables.
+    // The audio thread hands the table it faded away from back through retiredTables, so it never allocates or frees
+    std::atomic<MipTables*> publishedTables;
+    std::atomic<MipTables*> retiredTables;
+
+    // Table building state, shared by the UI thread and the wavetable loader under tablesMutex
+    std::mutex tablesMutex;
+    std::vector<MipTables*> freeTables;
+    MipTables* lastPublished = nullptr;
+    // Spectrum of the last published drawing, used to find the levels an edit touched
+    alignas(16) float spectrum[mipSize] = {};
+    dsp::RealFFT fft;
+    std::shared_ptr<const Wavetable> wavetable;
+    std::string wavetablePath;
+    // Bumped whenever something else is played, a load that finishes after that is dropped
+    int loadGeneration = 0;
+    std::thread loader;
+
+    // UI thread state
+    bool tableChanged = false;
+
+    // Audio thread state
+    MipTables* activeTables = nullptr;
+    MipTables* fadingTables = nullptr;
+    int fadeRemaining = 0;
+
+    enum FmDestination {
+        FM_FREQUENCY,
+        FM_POSITION
+    };
+    int fmDestination = FM_FREQUENCY;
+
+    // Editing is off while a wavetable file is played
     bool enableEditing = true;
     int nchannels = 1;
-    float phaseAccumulators[maxPolyphony] = {};
-    float phaseAdvance[maxPolyphony] = {};
+    int currentBanks = 1;
+    float_4 phaseAccumulators[maxBanks] = {};
+    float_4 phaseAdvance[maxBanks] = {};
+    int mipLevel[maxPolyphony] = {};
+    float_4 framePosition[maxBanks] = {};
     int loopcounter = 0;
 
     void initBuffer() {
@@ -40,16 +213,39 @@ struct WAVECRAFTER : Module {
         }
     }
 
-	WAVECRAFTER() {
+	WAVECRAFTER() : publishedTables(nullptr), retiredTables(nullptr), fft(mipSize) {
 		config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
-        configParam(FREQ_PARAM, 0.f, 10.f, 4.f, "");
-		configParam(FMPARAM_PARAM, 0.f, 1.f, 0.f, "");
-		configInput(VOCT_INPUT, "");
-		configInput(FM_INPUT, "");
-		configOutput(OUTPUT, "");
+        configParam(FREQ_PARAM, 0.f, 10.f, 4.f, "Frequency", " Hz", 2.f, 261.626f / 16.f);
+		configParam(FMPARAM_PARAM, -1.f, 1.f, 0.f, "Frequency modulation", "%", 0.f, 100.f);
+		configParam(POSITION_PARAM, 0.f, 1.f, 0.f, "Wavetable position", "%", 0.f, 100.f);
+		configInput(VOCT_INPUT, "1V/octave pitch");
+		configInput(FM_INPUT, "Frequency modulation");
+		configOutput(OUTPUT, "Audio");
+
+        // enough tables for the usual hand over, the UI thread only allocates more when the audio thread falls behind
+        for (int i = 0; i < 4; ++i) {
+            freeTables.push_back(new MipTables);
+        }
         initBuffer();
+        {
+            std::lock_guard<std::mutex> lock(tablesMutex);
+            updateMipLevels(true);
+        }
+        activeTables = publishedTables.exchange(nullptr);
 	}
 
+    ~WAVECRAFTER() {
+        if (loader.joinable())
+            loader.join();
+        delete activeTables;
+        delete fadingTables;
+        delete publishedTables.load();
+        delete retiredTables.load();
+        for (MipTables* tables : freeTables) {
+            delete tables;
+        }
+    }
+
     size_t numFadeSamples() {
         // Calculate the clicking prevention fade size (in samples)
         // based on the current buffer size.
@@ -61,9 +257,236 @@ struct WAVECRAFTER : Module {
         }
     }
 
+    json_t* dataToJson() override {
+        json_t* rootJ = json_object();
+        json_object_set_new(rootJ, "fmDestination", json_integer(fmDestination));
+
+        std::vector<uint8_t> data(drawingHeaderSize + 2 * buffer.size());
+        data[0] = drawingVersion;
+        writeLittleEndian(&data[1], buffer.size(), 4);
+        for (size_t i = 0; i < buffer.size(); ++i) {
+            writeLittleEndian(&data[drawingHeaderSize + 2 * i], std::round(clamp(buffer[i], 0.f, 1.f) * 65535.f), 2);
+        }
+        json_object_set_new(rootJ, "drawing", json_string(string::toBase64(data).c_str()));
+
+        std::lock_guard<std::mutex> lock(tablesMutex);
+        if (!wavetablePath.empty())
+            json_object_set_new(rootJ, "wavetable", json_string(wavetablePath.c_str()));
+        return rootJ;
+    }
+
+    void dataFromJson(json_t* rootJ) override {
+        json_t* fmDestinationJ = json_object_get(rootJ, "fmDestination");
+        if (fmDestinationJ)
+            fmDestination = clamp((int) json_integer_value(fmDestinationJ), (int) FM_FREQUENCY, (int) FM_POSITION);
+
+        json_t* drawingJ = json_object_get(rootJ, "drawing");
+        if (drawingJ && json_string_value(drawingJ)) {
+            // decoded straight into the drawing, the points never pass through a JSON array
+            std::vector<uint8_t> data = string::fromBase64(json_string_value(drawingJ));
+            uint32_t count = data.size() >= drawingHeaderSize ? WavFile::readLittleEndian(&data[1], 4) : 0;
+            if (data.size() >= drawingHeaderSize && data[0] == drawingVersion
+                    && count >= 2 && count <= maxDrawingPoints && data.size() >= drawingHeaderSize + 2 * count) {
+                std::lock_guard<std::mutex> lock(tablesMutex);
+                buffer.resize(count);
+                for (uint32_t i = 0; i < count; ++i) {
+                    buffer[i] = WavFile::readLittleEndian(&data[drawingHeaderSize + 2 * i], 2) / 65535.f;
+                }
+            }
+            else {
+                WARN("Could not read the saved drawing");
+            }
+        }
+
+        json_t* wavetableJ = json_object_get(rootJ, "wavetable");
+        if (wavetableJ && json_string_value(wavetableJ) && loadWavetable(json_string_value(wavetableJ)))
+            return;
+        playDrawing();
+    }
+
+    static void writeLittleEndian(uint8_t* bytes, uint32_t value, int count) {
+        for (int i = 0; i < count; ++i) {
+            bytes[i] = (value >> (8 * i)) & 0xff;
+        }
+    }
+
     void onReset() override {
-        enableEditing = true;
+        fmDestination = FM_FREQUENCY;
+        std::lock_guard<std::mutex> lock(tablesMutex);
         initBuffer();
+        startDrawing();
+    }
+
+    /*
+     * Go back from a wavetable file to the drawing. Runs on the UI thread
+     */
+    void playDrawing() {
+        std::lock_guard<std::mutex> lock(tablesMutex);
+        startDrawing();
+    }
+
+    /*
+     * Publish the drawing in place of a wavetable, must be called with tablesMutex held
+     */
+    void startDrawing() {
+        ++loadGeneration;
+        wavetable.reset();
+        wavetablePath.clear();
+        enableEditing = true;
+        updateMipLevels(true);
+    }
+
+    /*
+     * Play the wavetable file at path. Runs on the UI thread.
+     * The file is mapped and checked right away, its frames are band limited on a background thread.
+     * Returns false if the file can not be read
+     */
+    bool loadWavetable(const std::string& path) {
+        std::shared_ptr<const Wavetable> cached;
+        {
+            std::lock_guard<std::mutex> lock(wavetableCacheMutex);
+            auto it = wavetableCache.find(path);
+            if (it != wavetableCache.end())
+                cached = it->second.lock();
+        }
+        if (cached) {
+            enableEditing = false;
+            std::lock_guard<std::mutex> lock(tablesMutex);
+            ++loadGeneration;
+            playWavetable(cached, path);
+            return true;
+        }
+
+        std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+        WavFile wav;
+        if (!file->map(path) || !wav.parse(file->data, file->size)) {
+            WARN("Could not read wavetable %s", path.c_str());
+            return false;
+        }
+
+        // one load at a time, the previous one is almost always done by the time another file is picked
+        if (loader.joinable())
+            loader.join();
+        enableEditing = false;
+        int generation;
+        {
+            std::lock_guard<std::mutex> lock(tablesMutex);
+            generation = ++loadGeneration;
+        }
+        // the thread holds on to the mapping until the frames are built
+        loader = std::thread([this, file, wav, path, generation]() {
+            std::shared_ptr<const Wavetable> loaded = buildWavetable(wav);
+            {
+                std::lock_guard<std::mutex> lock(wavetableCacheMutex);
+                wavetableCache[path] = loaded;
+            }
+            std::lock_guard<std::mutex> lock(tablesMutex);
+            if (generation == loadGeneration)
+                playWavetable(loaded, path);
+        });
+        return true;
+    }
+
+    /*
+     * Publish the frames of a wavetable, must be called with tablesMutex held
+     */
+    void playWavetable(std::shared_ptr<const Wavetable> loaded, const std::string& path) {
+        wavetable = loaded;
+        wavetablePath = path;
+        MipTables* tables = takeFreeTables();
+        tables->wavetable = loaded;
+        tables->frames = loaded->frames.data();
+        tables->frameCount = loaded->frames.size();
+        publishTables(tables);
+    }
+
+    /*
+     * Make the band limited versions of the drawing by removing harmonics from its spectrum and publish them.
+     * Levels that only keep harmonics the edit did not change are copied from the last published drawing, unless all are rebuilt.
+     * Must be called with tablesMutex held, never from the audio thread
+     */
+    void updateMipLevels(bool rebuildAll) {
+        // only a published drawing has levels to copy
+        if (!lastPublished || lastPublished->frames != &lastPublished->drawing)
+            rebuildAll = true;
+
+        // resample the drawing to the mip resolution
+        alignas(16) float resampled[mipSize];
+        const int size = buffer.size();
+        for (int i = 0; i < mipSize; ++i) {
+            float position = float(i) * size / mipSize;
+            int index = int(position);
+            float frac = position - index;
+            // the drawing is one cycle, the last point leads back to the first
+            resampled[i] = crossfade(buffer[index], buffer[(index + 1) % size], frac);
+        }
+
+        // in the ordered spectrum bin 0 holds DC, bin 1 nyquist and bins 2k and 2k+1 harmonic k
+        alignas(16) float newSpectrum[mipSize];
+        fft.rfft(resampled, newSpectrum);
+        int lowestChanged = mipSize / 2;
+        const float threshold = 1e-6f * mipSize;
+        if (std::fabs(newSpectrum[0] - spectrum[0]) > threshold) {
+            lowestChanged = 0;
+        }
+        for (int harmonic = 1; harmonic < lowestChanged; ++harmonic) {
+            if (std::fabs(newSpectrum[2 * harmonic] - spectrum[2 * harmonic]) > threshold
+                    || std::fabs(newSpectrum[2 * harmonic + 1] - spectrum[2 * harmonic + 1]) > threshold) {
+                lowestChanged = harmonic;
+            }
+        }
+        std::copy(newSpectrum, newSpectrum + mipSize, spectrum);
+
+        MipTables* tables = takeFreeTables();
+        for (int level = 0; level < mipLevels; ++level) {
+            if (!rebuildAll && lowestChanged > levelHarmonics(level)) {
+                // the audio thread only reads the last published table, so copying from it is safe
+                const float* levelPoints = lastPublished->drawing.levels[level];
+                std::copy(levelPoints, levelPoints + mipSize + guardPoints, tables->drawing.levels[level]);
+                continue;
+            }
+            buildLevel(fft, newSpectrum, level, tables->drawing.levels[level]);
+        }
+        tables->frames = &tables->drawing;
+        tables->frameCount = 1;
+        publishTables(tables);
+    }
+
+    /*
+     * Get a table to build in, reusing the ones the audio thread retired. Must be called with tablesMutex held
+     */
+    MipTables* takeFreeTables() {
+        MipTables* retired = retiredTables.exchange(nullptr, std::memory_order_acquire);
+        if (retired) {
+            recycleTables(retired);
+        }
+        if (freeTables.empty()) {
+            return new MipTables;
+        }
+        MipTables* tables = freeTables.back();
+        freeTables.pop_back();
+        return tables;
+    }
+
+    /*
+     * Keep a table for reuse, letting go of the wavetable it played
+     */
+    void recycleTables(MipTables* tables) {
+        tables->wavetable.reset();
+        freeTables.push_back(tables);
+    }
+
+    /*
+     * Hand a finished table to the audio thread. Must be called with tablesMutex held
+     */
+    void publishTables(MipTables* tables) {
+        tables->fadeSamples = numFadeSamples();
+        lastPublished = tables;
+        // a table the audio thread did not pick up yet was never read and can be reused right away
+        MipTables* unused = publishedTables.exchange(tables, std::memory_order_acq_rel);
+        if (unused) {
+            recycleTables(unused);
+        }
     }
 
 	void process(const ProcessArgs& args) override {
@@ -77,69 +500,134 @@ struct WAVECRAFTER : Module {
 
     void process4Samples(const ProcessArgs& args){
 
+        // once the fade is over hand the old table back, then pick up a newly published one and fade over to it
+        if (fadingTables && fadeRemaining == 0 && retiredTables.load(std::memory_order_relaxed) == nullptr) {
+            retiredTables.store(fadingTables, std::memory_order_release);
+            fadingTables = nullptr;
+        }
+        if (!fadingTables && publishedTables.load(std::memory_order_relaxed) != nullptr) {
+            MipTables* tables = publishedTables.exchange(nullptr, std::memory_order_acquire);
+            if (tables) {
+                fadingTables = activeTables;
+                activeTables = tables;
+                fadeRemaining = tables->fadeSamples;
+            }
+        }
+
         nchannels = std::max(1, inputs[VOCT_INPUT].getChannels());
+        currentBanks = (nchannels + 3) / 4;
         outputs[OUTPUT].setChannels(nchannels);
         float pitchParam = params[FREQ_PARAM].value;
-        for (int i = 0; i < nchannels; ++i) {
-            float pitchCV = inputs[VOCT_INPUT].getVoltage(i);
-            float combinedPitch = pitchParam + pitchCV - 4.f;
-
-            const float q = float(std::log2(261.626));       // move up to C
-            combinedPitch += q;
+        float fmParam = params[FMPARAM_PARAM].getValue();
+        float positionParam = params[POSITION_PARAM].getValue();
+        const float q = float(std::log2(261.626));       // move up to C
+        for (int bank = 0; bank < currentBanks; ++bank) {
+            const int currentChannel = bank * 4;
+            float_4 pitchCV = inputs[VOCT_INPUT].getPolyVoltageSimd<float_4>(currentChannel);
+            float_4 combinedPitch = pitchParam + pitchCV - 4.f + q;
+
+            // exponential frequency modulation, or 10 V sweeping the whole wavetable, scaled by the attenuverter
+            float_4 fm = inputs[FM_INPUT].getPolyVoltageSimd<float_4>(currentChannel) * fmParam;
+            if (fmDestination == FM_POSITION) {
+                framePosition[bank] = simd::clamp(positionParam + 0.1f * fm, 0.f, 1.f);
+            }
+            else {
+                framePosition[bank] = positionParam;
+                combinedPitch += fm;
+            }
 
             // Combined pitch is in volts. Now use an exponential function
             // to convert that to a pitch.
-            // This time we use the fast exp approximation from the VCV SDK.
-            // NEW 4 VCO2
-            const float freq = rack::dsp::approxExp2_taylor5(combinedPitch);
+            const float_4 freq = rack::dsp::approxExp2_taylor5<float_4>(combinedPitch);
 
             // figure out how much to add to our ramp every cycle
             // to make a saw at the desired frequency.
             // restrict the range to something reasonable to avoid bugs.
-            float normalizedFreq = args.sampleTime * freq;
-            math::clamp(normalizedFreq, 1e-6f, 0.35f);
-            phaseAdvance[i] = normalizedFreq;
+            phaseAdvance[bank] = simd::clamp(args.sampleTime * freq, 1e-6f, 0.35f);
+
+            // pick the level with the most harmonics that all stay below nyquist
+            for (int lane = 0; lane < 4; ++lane) {
+                float level = std::ceil(std::log2(mipSize * phaseAdvance[bank][lane]));
+                mipLevel[currentChannel + lane] = clamp(int(level), 0, mipLevels - 1);
+            }
         }
     }
 
+    /*
+     * Read the table for every voice, four voices at a time
+     */
     void generateOutput() {
 
-        int size = buffer.size();
-        float inOutMin = -5;
-        float inOutMax = 5;
-        for(int chan = 0; chan < nchannels; chan++) {
-            phaseAccumulators[chan] += phaseAdvance[chan];
-            if (phaseAccumulators[chan] > 1.f) {
-                // We limit our phase to the range 0..1
-                // Note that this code assumes phaseAccumulators[i] < 1.
-                // We have clamped the values already, so we know this is true.
-                phaseAccumulators[chan] -= 1.f;
+        // weight of the table being faded away from
+        float fade = 0.f;
+        if (fadeRemaining > 0) {
+            fade = float(fadeRemaining) / activeTables->fadeSamples;
+            --fadeRemaining;
+        }
+
+        for (int bank = 0; bank < currentBanks; ++bank) {
+            // We limit our phase to the range 0..1
+            phaseAccumulators[bank] += phaseAdvance[bank];
+            phaseAccumulators[bank] -= simd::floor(phaseAccumulators[bank]);
+
+            float_4 y = readTables(activeTables, bank);
+            if (fade > 0.f) {
+                y += fade * (readTables(fadingTables, bank) - y);
+            }
+
+            // rescale from 0..1 to -5..5 V
+            outputs[OUTPUT].setVoltageSimd(10.f * y - 5.f, bank * 4);
+        }
+    }
+
+    /*
+     * Interpolated value of the mip level every voice of a bank plays at its phase
+     */
+    float_4 readTables(const MipTables* tables, int bank) {
+        // the phase is below 1, rounding can only land exactly on mipSize which the mask wraps to 0
+        float_4 position = phaseAccumulators[bank] * mipSize;
+        simd::int32_4 index = simd::int32_4(_mm_cvttps_epi32(position.v));
+        float_4 frac = position - float_4(_mm_cvtepi32_ps(index.v)); // fractional part of phase
+        index = index & simd::int32_4(mipSize - 1);
+
+        const float* rows[4];
+        float_4 a, b, c, d;
+        if (tables->frameCount == 1) {
+            for (int lane = 0; lane < 4; ++lane) {
+                rows[lane] = tables->frames[0].levels[mipLevel[bank * 4 + lane]];
+            }
+            loadPoints(rows, index, a, b, c, d);
+        }
+        else {
+            // morph between the two frames around the position of every voice
+            float_4 framePos = framePosition[bank] * float(tables->frameCount - 1);
+            float_4 frame = simd::fmin(simd::floor(framePos), float(tables->frameCount - 2));
+            float_4 morph = framePos - frame;
+
+            float_4 nextA, nextB, nextC, nextD;
+            for (int lane = 0; lane < 4; ++lane) {
+                rows[lane] = tables->frames[(int) frame[lane]].levels[mipLevel[bank * 4 + lane]];
             }
-            float phase = phaseAccumulators[chan];
-
-            // interpolated output, based on tabread4_tilde_perform() in
-            // https://github.com/pure-data/pure-data/blob/master/src/d_array.c
-            //TODO: adjust symmetry of surrounding indices (based on range polarity)?
-            int i = clamp((int) std::floor(phase * size), 0, size - 1);
-            int ia, ib, ic, id;
-            ia = clamp(i - 1, 0, size - 1);
-            ib = clamp(i + 0, 0, size - 1);
-            ic = clamp(i + 1, 0, size - 1);
-            id = clamp(i + 2, 0, size - 1);
-            float a = buffer[ia];
-            float b = buffer[ib];
-            float c = buffer[ic];
-            float d = buffer[id];
-
-            // Pd algorithm magic
-            float frac = phase * size - i; // fractional part of phase
-            float y = b + frac * (
-                    c - b - 0.1666667f * (1.f - frac) * (
-                            (d - a - 3.f * (c - b)) * frac + (d + 2.f * a - 3.f * b)
-                    )
-            );
-            outputs[OUTPUT].setVoltage(rescale(y, 0.f, 1.f, inOutMin, inOutMax), chan);
+            loadPoints(rows, index, a, b, c, d);
+            for (int lane = 0; lane < 4; ++lane) {
+                rows[lane] = tables->frames[(int) frame[lane] + 1].levels[mipLevel[bank * 4 + lane]];
+            }
+            loadPoints(rows, index, nextA, nextB, nextC, nextD);
+
+            a += morph * (nextA - a);
+            b += morph * (nextB - b);
+            c += morph * (nextC - c);
+            d += morph * (nextD - d);
         }
+
+        // interpolated output, based on tabread4_tilde_perform() in
+        // https://github.com/pure-data/pure-data/blob/master/src/d_array.c
+        // Pd algorithm magic
+        return b + frac * (
+                c - b - 0.1666667f * (1.f - frac) * (
+                        (d - a - 3.f * (c - b)) * frac + (d + 2.f * a - 3.f * b)
+                )
+        );
     }
 };
 
@@ -159,15 +647,27 @@ struct Display : OpaqueWidget {
 
         if(module) {
 
-            // draw the array contents
+            // draw the array contents, or the frame of a loaded wavetable closest to the position
+            std::shared_ptr<const Wavetable> wavetable;
+            {
+                std::lock_guard<std::mutex> lock(module->tablesMutex);
+                wavetable = module->wavetable;
+            }
+            const float* points = module->buffer.data();
             int s = module->buffer.size();
+            if (wavetable) {
+                float position = module->params[WAVECRAFTER::POSITION_PARAM].getValue();
+                int frame = std::round(position * (wavetable->frames.size() - 1));
+                points = wavetable->frames[frame].levels[0] + 1;
+                s = mipSize;
+            }
             float w = box.size.x * 1.f / s;
             nvgBeginPath(vg);
             if(s < box.size.x) {
                 for(int i = 0; i < s; i++) {
                     float x1 = i * w;
                     float x2 = (i + 1) * w;
-                    float y = (1.f - module->buffer[i]) * box.size.y;
+                    float y = (1.f - points[i]) * box.size.y;
 
                     if(i == 0) nvgMoveTo(vg, x1, y);
                     else nvgLineTo(vg, x1, y);
@@ -179,7 +679,7 @@ struct Display : OpaqueWidget {
                     //int i1 = clamp(int(rescale(i, 0, box.size.x - 1, 0, s - 1)), 0, s - 1);
                     // just use the left edge (should really use average over i1..i2 instead...
                     int ii = clamp(int(rescale(i, 0, box.size.x - 1, 0, s - 1)), 0, s - 1);
-                    float y = (1.f - module->buffer[ii]) * box.size.y;
+                    float y = (1.f - points[ii]) * box.size.y;
                     if(i == 0) nvgMoveTo(vg, 0, y);
                     else nvgLineTo(vg, i, y);
                 }
@@ -255,10 +755,20 @@ struct Display : OpaqueWidget {
                 module->buffer[i] = y;
             }
         }
+        module->tableChanged = true;
     }
 
     void step() override {
         OpaqueWidget::step();
+
+        // band limit the drawing at most once per frame, outside the audio thread
+        if (module && module->tableChanged) {
+            module->tableChanged = false;
+            if (module->enableEditing) {
+                std::lock_guard<std::mutex> lock(module->tablesMutex);
+                module->updateMipLevels(false);
+            }
+        }
     }
 };
 
@@ -287,6 +797,35 @@ struct WAVECRAFTERWidget : ModuleWidget {
         display->box.pos = Vec(5, 35);
         addChild(display);
 	}
+
+    void appendContextMenu(Menu* menu) override {
+        WAVECRAFTER* module = getModule<WAVECRAFTER>();
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createMenuLabel("Wavetable"));
+        std::string path;
+        {
+            std::lock_guard<std::mutex> lock(module->tablesMutex);
+            path = module->wavetablePath;
+        }
+        if (!path.empty())
+            menu->addChild(createMenuLabel(system::getFilename(path)));
+        menu->addChild(createMenuItem("Load wavetable...", "", [=]() {
+            osdialog_filters* filters = osdialog_filters_parse("Wavetable:wav,WAV");
+            char* pathC = osdialog_file(OSDIALOG_OPEN, NULL, NULL, filters);
+            osdialog_filters_free(filters);
+            if (!pathC)
+                return;
+            std::string selected = pathC;
+            std::free(pathC);
+            module->loadWavetable(selected);
+        }));
+        menu->addChild(createMenuItem("Draw a single cycle", "", [=]() {
+            module->playDrawing();
+        }, module->enableEditing));
+        menu->addChild(new GL_MenuSlider(module->paramQuantities[WAVECRAFTER::POSITION_PARAM]));
+        menu->addChild(createIndexPtrSubmenuItem("FM input", {"Frequency", "Wavetable position"}, &module->fmDestination));
+    }
 };
 
 
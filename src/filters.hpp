@@ -2,14 +2,15 @@
 #include "stdio.h"
 
 /*
- * IIR convolution function implementation with arbitrary order
+ * IIR convolution function implementation with arbitrary order.
+ * T may be float or simd::float_4 to run four filters with their own coefficients at once
  */
-template <int ORDER>
+template <int ORDER, typename T = float>
 struct IIR {
-    float bCoef[ORDER+1] = {};  // feedforward
-    float aCoef[ORDER] = {};    // feedback
-    float xCoef[ORDER];         // input history
-    float yCoef[ORDER];         // output history
+    T bCoef[ORDER+1] = {};  // feedforward
+    T aCoef[ORDER] = {};    // feedback
+    T xCoef[ORDER];         // input history
+    T yCoef[ORDER];         // output history
 
     /*
      * Constrcutor resets all arrays to contain 0's
@@ -26,8 +27,8 @@ struct IIR {
     /*
      * Process a single sample
      */
-    float process(float in) {
-        float out = 0.f;
+    T process(T in) {
+        T out = 0.f;
         // Add x state
         if (0 < ORDER+1) {
             out = bCoef[0] * in;
@@ -57,14 +58,15 @@ struct IIR {
  * Biquad filter implementation
  * IIR filter of order 2
  */
-struct Biquad : IIR<2> {
+template <typename T = float>
+struct TBiquad : IIR<2, T> {
 public:
     /*
      * Set IIR filter coefficients for it to act as a low pass filter with desired cutoff frequency
      */
-    void setParametersLow(float cutoff){
-        float K = tan(M_PI * cutoff);
-        float norm = 1.f / (1.f + sqrt(2)*K + K * K);
+    void setParametersLow(T cutoff){
+        T K = tan(M_PI * cutoff);
+        T norm = 1.f / (1.f + sqrt(2)*K + K * K);
         this->bCoef[0] = K * K * norm;
         this->bCoef[1] = 2.f * this->bCoef[0];
         this->bCoef[2] = this->bCoef[0];
@@ -74,9 +76,9 @@ public:
     /*
      * Set IIR filter coefficients for it to act as a band pass filter with desired cutoff frequency
      */
-    void setParametersBand(float cutoff, float quality){
-        float K = tan(M_PI * cutoff);
-        float norm = 1.f / (1.f + K / quality + K * K);
+    void setParametersBand(T cutoff, T quality){
+        T K = tan(M_PI * cutoff);
+        T norm = 1.f / (1.f + K / quality + K * K);
         this->bCoef[0] = K / quality * norm;
         this->bCoef[1] = 0.f;
         this->bCoef[2] = -this->bCoef[0];
@@ -86,9 +88,9 @@ public:
     /*
      * Set IIR filter coefficients for it to act as a high pass filter with desired cutoff frequency
      */
-    void setParametersHigh(float cutoff){
-        float K = tan(M_PI * cutoff);
-        float norm = 1.f / (1.f + sqrt(2) * K + K * K);
+    void setParametersHigh(T cutoff){
+        T K = tan(M_PI * cutoff);
+        T norm = 1.f / (1.f + sqrt(2) * K + K * K);
         this->bCoef[0] = norm;
         this->bCoef[1] = -2.f * this->bCoef[0];
         this->bCoef[2] = this->bCoef[0];
@@ -123,6 +125,8 @@ public:
     }
 };
 
+typedef TBiquad<> Biquad;
+
 
 struct Cascade6PButterFilter{
     Biquad filters[3];
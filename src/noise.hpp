@@ -0,0 +1,110 @@
+#pragma once
+#include <rack.hpp>
+
+using namespace rack;
+
+/*
+ * Four lane random number generator.
+ * Every lane is a 32 bit linear congruential generator whose state is scrambled into the output,
+ * so lanes can be seeded on their own stream and jumped ahead in logarithmic time.
+ */
+struct NoiseGenerator4 {
+    static const uint32_t multiplier = 747796405u;
+    static const uint32_t increment = 2891336453u;
+
+    // Distance between the streams of two channels, 16 channels cover the whole period
+    static const uint64_t channelSpacing = 1ull << 28;
+
+    simd::int32_4 state = simd::int32_4::zero();
+
+    /*
+     * Start every lane on the stream of its channel, lane i gets channel firstChannel + i
+     */
+    void seed(uint32_t value, int firstChannel) {
+        for (int lane = 0; lane < 4; ++lane) {
+            state[lane] = (int32_t) advance(value, (firstChannel + lane) * channelSpacing);
+        }
+    }
+
+    /*
+     * Seed a single lane to an explicit state
+     */
+    void seedLane(int lane, uint32_t value) {
+        state[lane] = (int32_t) value;
+    }
+
+    /*
+     * Skip ahead the given number of outputs on every lane
+     */
+    void jump(uint64_t steps) {
+        uint32_t jumpMultiplier;
+        uint32_t jumpIncrement;
+        jumpCoefficients(steps, jumpMultiplier, jumpIncrement);
+        state = multiply(state, jumpMultiplier) + simd::int32_4((int32_t) jumpIncrement);
+    }
+
+    /*
+     * Next 32 random bits of every lane
+     */
+    simd::int32_4 next() {
+        state = multiply(state, multiplier) + simd::int32_4((int32_t) increment);
+
+        // scramble the state, the low bits of a power of two congruential generator are not random on their own
+        simd::int32_4 x = state ^ shiftRight(state, 16);
+        x = multiply(x, 0x7feb352du);
+        x = x ^ shiftRight(x, 15);
+        x = multiply(x, 0x846ca68bu);
+        return x ^ shiftRight(x, 16);
+    }
+
+    /*
+     * Next uniformly distributed value between -1 and 1 of every lane
+     */
+    simd::float_4 uniform() {
+        // the top 24 bits as a signed value fit a float exactly, the shift operator on int32_4 does not keep the sign
+        simd::int32_4 bits = simd::int32_4(_mm_srai_epi32(next().v, 8));
+        return simd::float_4(_mm_cvtepi32_ps(bits.v)) * (1.f / (1 << 23));
+    }
+
+    /*
+     * Lane wise multiplication modulo 2^32
+     */
+    static simd::int32_4 multiply(simd::int32_4 x, uint32_t factor) {
+        return simd::int32_4(_mm_mullo_epi32(x.v, _mm_set1_epi32((int32_t) factor)));
+    }
+
+    /*
+     * Logical shift, zeros are shifted in from the top
+     */
+    static simd::int32_4 shiftRight(simd::int32_4 x, int bits) {
+        return simd::int32_4(_mm_srli_epi32(x.v, bits));
+    }
+
+    /*
+     * Multiplier and increment that advance the generator by the given number of steps at once
+     */
+    static void jumpCoefficients(uint64_t steps, uint32_t& jumpMultiplier, uint32_t& jumpIncrement) {
+        uint32_t accMultiplier = 1u;
+        uint32_t accIncrement = 0u;
+        uint32_t curMultiplier = multiplier;
+        uint32_t curIncrement = increment;
+        while (steps > 0) {
+            if (steps & 1) {
+                accMultiplier *= curMultiplier;
+                accIncrement = accIncrement * curMultiplier + curIncrement;
+            }
+            curIncrement = (curMultiplier + 1u) * curIncrement;
+            curMultiplier *= curMultiplier;
+            steps >>= 1;
+        }
+        jumpMultiplier = accMultiplier;
+        jumpIncrement = accIncrement;
+    }
+
+    static uint32_t advance(uint32_t state, uint64_t steps) {
+        uint32_t jumpMultiplier;
+        uint32_t jumpIncrement;
+        jumpCoefficients(steps, jumpMultiplier, jumpIncrement);
+        return state * jumpMultiplier + jumpIncrement;
+    }
+};
@@ -34,3 +34,11 @@ struct GL_SlidePot : app::SvgSlider {
         handle->wrap();
     }
 };
+
+// Context menu slider bound to a module parameter, for settings that have no room on the panel
+struct GL_MenuSlider : ui::Slider {
+    GL_MenuSlider(ParamQuantity* paramQuantity) {
+        quantity = paramQuantity;
+        box.size.x = 200.f;
+    }
+};
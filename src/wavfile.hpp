@@ -0,0 +1,198 @@
+#pragma once
+#include <rack.hpp>
+#if defined ARCH_WIN
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace rack;
+
+/*
+ * Read only memory mapping of a whole file.
+ * Pages are only read from disk when they are touched, so large files are never copied as a whole
+ */
+struct MappedFile {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+#if defined ARCH_WIN
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#endif
+
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        unmap();
+    }
+
+    /*
+     * Map the file at path, returns false if it can not be opened or is empty
+     */
+    bool map(const std::string& path) {
+        unmap();
+#if defined ARCH_WIN
+        file = CreateFileW(string::UTF8toUTF16(path).c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+            unmap();
+            return false;
+        }
+        mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping == NULL) {
+            unmap();
+            return false;
+        }
+        data = (const uint8_t*) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!data) {
+            unmap();
+            return false;
+        }
+        size = fileSize.QuadPart;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat status;
+        if (fstat(fd, &status) != 0 || status.st_size <= 0) {
+            ::close(fd);
+            return false;
+        }
+        // the mapping stays valid after the descriptor is closed
+        void* mapped = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED)
+            return false;
+        data = (const uint8_t*) mapped;
+        size = status.st_size;
+#endif
+        return true;
+    }
+
+    void unmap() {
+#if defined ARCH_WIN
+        if (data)
+            UnmapViewOfFile(data);
+        if (mapping != NULL)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = NULL;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data)
+            munmap((void*) data, size);
+#endif
+        data = nullptr;
+        size = 0;
+    }
+};
+
+/*
+ * View on the sample data of a RIFF WAVE file in memory.
+ * Supports 8, 16, 24 and 32 bit integer and 32 bit float samples, only the first channel is read
+ */
+struct WavFile {
+    enum Format {
+        PCM_FORMAT = 1,
+        FLOAT_FORMAT = 3,
+        EXTENSIBLE_FORMAT = 0xFFFE
+    };
+
+    const uint8_t* samples = nullptr;
+    size_t length = 0;          // samples per channel
+    int format = 0;
+    int bytesPerSample = 0;
+    int blockAlign = 0;
+    // Samples per wavetable frame as stored in a "clm " chunk, 0 when the file has none or it is out of range
+    int cycleLength = 0;
+    static const int maxCycleLength = 65536;
+
+    /*
+     * Find the format and sample data of the file, returns false if it is not a WAV file this can read
+     */
+    bool parse(const uint8_t* data, size_t size) {
+        if (size < 12 || std::memcmp(data, "RIFF", 4) != 0 || std::memcmp(data + 8, "WAVE", 4) != 0)
+            return false;
+
+        bool formatFound = false;
+        size_t position = 12;
+        while (position + 8 <= size) {
+            const uint8_t* chunk = data + position;
+            size_t chunkSize = readLittleEndian(chunk + 4, 4);
+            const uint8_t* body = chunk + 8;
+            size_t available = std::min(chunkSize, size - position - 8);
+
+            if (std::memcmp(chunk, "fmt ", 4) == 0 && available >= 16) {
+                format = readLittleEndian(body, 2);
+                int channels = readLittleEndian(body + 2, 2);
+                blockAlign = readLittleEndian(body + 12, 2);
+                bytesPerSample = readLittleEndian(body + 14, 2) / 8;
+                // the sub format of an extensible header starts with the plain format code
+                if (format == EXTENSIBLE_FORMAT && available >= 26)
+                    format = readLittleEndian(body + 24, 2);
+                if (channels < 1 || bytesPerSample < 1 || blockAlign < channels * bytesPerSample)
+                    return false;
+                formatFound = true;
+            }
+            else if (std::memcmp(chunk, "clm ", 4) == 0 && available > 3 && std::memcmp(body, "<!>", 3) == 0) {
+                // Serum style wavetables write their frame size as text, like "<!>2048 01000000 wavetable"
+                cycleLength = 0;
+                for (size_t i = 3; i < available && body[i] >= '0' && body[i] <= '9'; ++i) {
+                    cycleLength = cycleLength * 10 + (body[i] - '0');
+                    // stop before a hostile number of digits overflows, the default frame size is used instead
+                    if (cycleLength > maxCycleLength) {
+                        cycleLength = 0;
+                        break;
+                    }
+                }
+            }
+            else if (std::memcmp(chunk, "data", 4) == 0 && formatFound) {
+                samples = body;
+                length = available / blockAlign;
+            }
+
+            // chunks are padded to an even size
+            position += 8 + chunkSize + (chunkSize & 1);
+        }
+
+        bool supported = (format == PCM_FORMAT && bytesPerSample >= 1 && bytesPerSample <= 4)
+                || (format == FLOAT_FORMAT && bytesPerSample == 4);
+        return supported && samples && length > 0;
+    }
+
+    /*
+     * Sample of the first channel scaled to -1..1
+     */
+    float sample(size_t index) const {
+        const uint8_t* bytes = samples + index * blockAlign;
+        if (format == FLOAT_FORMAT) {
+            float value;
+            std::memcpy(&value, bytes, sizeof(value));
+            return value;
+        }
+        // 8 bit samples are unsigned, wider ones signed
+        if (bytesPerSample == 1)
+            return (bytes[0] - 128) / 128.f;
+        int32_t value = (int32_t) (readLittleEndian(bytes, bytesPerSample) << (32 - 8 * bytesPerSample));
+        return value / 2147483648.f;
+    }
+
+    static uint32_t readLittleEndian(const uint8_t* bytes, int count) {
+        uint32_t value = 0;
+        for (int i = count - 1; i >= 0; --i) {
+            value = (value << 8) | bytes[i];
+        }
+        return value;
+    }
+};